@@ -8,9 +8,11 @@ do
   echo "Processing sequences in $dir..."
   pushd $dir
   mkdir -p results
-  pv sequences_10h_all.json | $PLAIN_MM > results/plain_mm_all.json
-  pv sequences_10h_respondents.json | $PLAIN_MM > results/plain_mm_respondents.json
-  pv sequences_10h_se_asia.json | $PLAIN_MM > results/plain_mm_se_asia.json
+  pv sequences_10h_all.json \
+    | $PLAIN_MM \
+        --cohort all_respondents.txt results/plain_mm_respondents.json \
+        --cohort se_asia_respondents.txt results/plain_mm_se_asia.json \
+    > results/plain_mm_all.json
   echo "Done with $dir..."
   popd
 done
@@ -6,6 +6,7 @@ BUILD_DIR=/srv/data/mooc/clickstream-hmm/build
 CLICKSTREAM_HMM=$BUILD_DIR/clickstream-hmm
 RETROFIT_HMM=$BUILD_DIR/retrofit-hmm
 PRINT_HMM=$BUILD_DIR/print-hmm
+DECODE=$BUILD_DIR/decode
 
 for dir in "$@"
 do
@@ -19,6 +20,8 @@ do
   $PRINT_HMM json hmm-model.gz > states.json
   $PRINT_HMM json-trans hmm-model.gz > all_trans.json
   $PRINT_HMM json-trans hmm-model_se_asia.gz > se_asia_trans.json
+  cat ../../sequences_10h_se_asia.json \
+    | $DECODE hmm-model.gz hmm-model_se_asia.gz > se_asia_decoded.json
   popd
 
   echo "Done with $dir..."
@@ -0,0 +1,100 @@
+/**
+ * @file block_reader.h
+ * Reads records from a stream in bounded-size blocks, prefetching the
+ * next block on a background thread while the current one is being
+ * processed.
+ */
+
+#ifndef CLICKSTREAM_BLOCK_READER_H_
+#define CLICKSTREAM_BLOCK_READER_H_
+
+#include <functional>
+#include <future>
+#include <istream>
+#include <vector>
+
+namespace meta
+{
+
+/**
+ * Reads records of type T from a stream in blocks of at most block_size
+ * records. At most two blocks are alive at once: the one handed out by
+ * next() and the one being prefetched, so memory is bounded by the block
+ * size regardless of the size of the input.
+ */
+template <class T>
+class block_reader
+{
+  public:
+    /**
+     * Reads a single record from the stream, returning false at the end
+     * of the input.
+     */
+    using read_function = std::function<bool(std::istream&, T&)>;
+
+    /**
+     * @param input The stream to read from (which must outlive the
+     * reader, and must be seekable if rewind() is used)
+     * @param block_size The maximum number of records per block
+     * @param read The function to read a single record with
+     */
+    block_reader(std::istream& input, uint64_t block_size, read_function read)
+        : input_(input), block_size_{block_size}, read_{std::move(read)}
+    {
+        prefetch();
+    }
+
+    block_reader(const block_reader&) = delete;
+    block_reader& operator=(const block_reader&) = delete;
+
+    ~block_reader()
+    {
+        if (next_.valid())
+            next_.wait();
+    }
+
+    /**
+     * Replaces block with the next block of records.
+     * @return false if the input has been exhausted
+     */
+    bool next(std::vector<T>& block)
+    {
+        block = next_.get();
+        if (block.empty())
+            return false;
+        prefetch();
+        return true;
+    }
+
+    /**
+     * Starts over from the beginning of the input.
+     */
+    void rewind()
+    {
+        if (next_.valid())
+            next_.wait();
+        input_.clear();
+        input_.seekg(0);
+        prefetch();
+    }
+
+  private:
+    void prefetch()
+    {
+        next_ = std::async(std::launch::async, [this]() {
+            std::vector<T> block;
+            block.reserve(block_size_);
+            T record;
+            while (block.size() < block_size_ && read_(input_, record))
+                block.push_back(std::move(record));
+            return block;
+        });
+    }
+
+    std::istream& input_;
+    uint64_t block_size_;
+    read_function read_;
+    std::future<std::vector<T>> next_;
+};
+}
+#endif
@@ -0,0 +1,334 @@
+/**
+ * @file dense_counts.h
+ * Dense expected counts for Markov models and for sequence observation
+ * distributions. Unlike the expected_counts_type of the underlying
+ * models, these can be scaled and serialized, which is needed when
+ * blending statistics across mini-batches or shipping them between
+ * processes.
+ */
+
+#ifndef CLICKSTREAM_DENSE_COUNTS_H_
+#define CLICKSTREAM_DENSE_COUNTS_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "model_builder.h"
+
+#include "meta/io/packed.h"
+#include "meta/sequence/hmm/sequence_observations.h"
+#include "meta/sequence/markov_model.h"
+
+namespace meta
+{
+namespace sequence
+{
+
+/**
+ * Expected initial state and transition counts for a first-order Markov
+ * model, stored as dense arrays.
+ */
+class markov_counts
+{
+  public:
+    markov_counts() = default;
+
+    /**
+     * Creates empty counts shaped like the given model. Either group of
+     * counts can be left out, in which case it takes no space and
+     * estimate() keeps the corresponding parameters of the prototype.
+     */
+    markov_counts(const markov_model& model, bool initial = true,
+                  bool transitions = true)
+        : num_states_{model.num_states()},
+          initial_(initial ? num_states_ : 0),
+          transitions_(transitions ? num_states_ * num_states_ : 0)
+    {
+        // nothing
+    }
+
+    void increment(const std::vector<state_id>& seq, double amount)
+    {
+        increment_initial(seq[0], amount);
+        for (uint64_t t = 1; t < seq.size(); ++t)
+            increment_transition(seq[t - 1], seq[t], amount);
+    }
+
+    void increment_initial(state_id s, double amount)
+    {
+        initial_[s] += amount;
+    }
+
+    void increment_transition(state_id from, state_id to, double amount)
+    {
+        transitions_[index(from, to)] += amount;
+    }
+
+    bool has_initial() const
+    {
+        return !initial_.empty();
+    }
+
+    bool has_transitions() const
+    {
+        return !transitions_.empty();
+    }
+
+    markov_counts& operator+=(const markov_counts& other)
+    {
+        add(other, 1.0);
+        return *this;
+    }
+
+    /**
+     * Adds weight * other to these counts.
+     */
+    void add(const markov_counts& other, double weight)
+    {
+        for (uint64_t i = 0; i < initial_.size(); ++i)
+            initial_[i] += weight * other.initial_[i];
+        for (uint64_t i = 0; i < transitions_.size(); ++i)
+            transitions_[i] += weight * other.transitions_[i];
+    }
+
+    /**
+     * Replaces the counts with the model's probabilities, so that
+     * estimate() recovers (up to smoothing) the same model.
+     */
+    void assign(const markov_model& model)
+    {
+        for (state_id i{0}; i < num_states_; ++i)
+        {
+            if (has_initial())
+                initial_[i] = model.initial_probability(i);
+            if (!has_transitions())
+                continue;
+            for (state_id j{0}; j < num_states_; ++j)
+                transitions_[index(i, j)] = model.transition_probability(i, j);
+        }
+    }
+
+    /**
+     * Raises any count below min_count to min_count.
+     */
+    void clamp(double min_count)
+    {
+        for (auto& count : initial_)
+            count = std::max(count, min_count);
+        for (auto& count : transitions_)
+            count = std::max(count, min_count);
+    }
+
+    /**
+     * @return the sum of the squares of the counts
+     */
+    double sum_of_squares() const
+    {
+        double sum = 0;
+        for (const auto& count : initial_)
+            sum += count * count;
+        for (const auto& count : transitions_)
+            sum += count * count;
+        return sum;
+    }
+
+    markov_counts& operator*=(double factor)
+    {
+        for (auto& count : initial_)
+            count *= factor;
+        for (auto& count : transitions_)
+            count *= factor;
+        return *this;
+    }
+
+    /**
+     * Estimates a new model from these counts, smoothed with the prior of
+     * the given (previous) model. Groups of counts that were left out keep
+     * the prototype's parameters exactly.
+     */
+    markov_model estimate(const markov_model& prototype) const
+    {
+        if (!has_initial() && !has_transitions())
+            return prototype;
+
+        auto counts = prototype.expected_counts();
+        for (state_id i{0}; i < num_states_; ++i)
+        {
+            if (has_initial() && initial_[i] > 0)
+                counts.increment_initial(i, initial_[i]);
+            if (!has_transitions())
+                continue;
+            for (state_id j{0}; j < num_states_; ++j)
+            {
+                auto count = transitions_[index(i, j)];
+                if (count > 0)
+                    counts.increment_transition(i, j, count);
+            }
+        }
+        markov_model estimated{std::move(counts)};
+
+        if (!has_initial())
+            return splice_markov_models(prototype, estimated);
+        if (!has_transitions())
+            return splice_markov_models(estimated, prototype);
+        return estimated;
+    }
+
+    uint64_t num_states() const
+    {
+        return num_states_;
+    }
+
+    template <class OutputStream>
+    void save(OutputStream& os) const
+    {
+        io::packed::write(os, num_states_);
+        io::packed::write(os, has_initial());
+        io::packed::write(os, has_transitions());
+        for (const auto& count : initial_)
+            io::packed::write(os, count);
+        for (const auto& count : transitions_)
+            io::packed::write(os, count);
+    }
+
+    template <class InputStream>
+    void load(InputStream& is)
+    {
+        bool initial, transitions;
+        io::packed::read(is, num_states_);
+        io::packed::read(is, initial);
+        io::packed::read(is, transitions);
+        initial_.resize(initial ? num_states_ : 0);
+        transitions_.resize(transitions ? num_states_ * num_states_ : 0);
+        for (auto& count : initial_)
+            io::packed::read(is, count);
+        for (auto& count : transitions_)
+            io::packed::read(is, count);
+    }
+
+  private:
+    uint64_t index(state_id from, state_id to) const
+    {
+        return static_cast<uint64_t>(from) * num_states_
+               + static_cast<uint64_t>(to);
+    }
+
+    uint64_t num_states_ = 0;
+    std::vector<double> initial_;
+    std::vector<double> transitions_;
+};
+
+/**
+ * Expected counts for a sequence_observations distribution: one set of
+ * Markov model counts per hidden state.
+ */
+class sequence_observation_counts
+{
+  public:
+    sequence_observation_counts() = default;
+
+    /**
+     * Creates empty counts shaped like the given distribution.
+     */
+    sequence_observation_counts(const hmm::sequence_observations& dist)
+    {
+        counts_.reserve(dist.num_states());
+        for (state_id s{0}; s < dist.num_states(); ++s)
+            counts_.emplace_back(dist.distribution(s));
+    }
+
+    void increment(const std::vector<state_id>& seq, state_id s, double prob)
+    {
+        counts_[s].increment(seq, prob);
+    }
+
+    sequence_observation_counts&
+    operator+=(const sequence_observation_counts& other)
+    {
+        add(other, 1.0);
+        return *this;
+    }
+
+    void add(const sequence_observation_counts& other, double weight)
+    {
+        for (uint64_t s = 0; s < counts_.size(); ++s)
+            counts_[s].add(other.counts_[s], weight);
+    }
+
+    void assign(const hmm::sequence_observations& dist)
+    {
+        for (state_id s{0}; s < counts_.size(); ++s)
+            counts_[s].assign(dist.distribution(s));
+    }
+
+    void clamp(double min_count)
+    {
+        for (auto& counts : counts_)
+            counts.clamp(min_count);
+    }
+
+    double sum_of_squares() const
+    {
+        double sum = 0;
+        for (const auto& counts : counts_)
+            sum += counts.sum_of_squares();
+        return sum;
+    }
+
+    sequence_observation_counts& operator*=(double factor)
+    {
+        for (auto& counts : counts_)
+            counts *= factor;
+        return *this;
+    }
+
+    /**
+     * Estimates a new distribution from these counts, smoothed with the
+     * priors of the given (previous) distribution.
+     */
+    hmm::sequence_observations
+    estimate(const hmm::sequence_observations& prototype) const
+    {
+        std::vector<markov_model> models;
+        models.reserve(counts_.size());
+        for (state_id s{0}; s < counts_.size(); ++s)
+            models.push_back(counts_[s].estimate(prototype.distribution(s)));
+        return make_sequence_observations(models);
+    }
+
+    template <class OutputStream>
+    void save(OutputStream& os) const
+    {
+        io::packed::write(os, static_cast<uint64_t>(counts_.size()));
+        for (const auto& counts : counts_)
+            counts.save(os);
+    }
+
+    template <class InputStream>
+    void load(InputStream& is)
+    {
+        uint64_t size;
+        io::packed::read(is, size);
+        counts_.resize(size);
+        for (auto& counts : counts_)
+            counts.load(is);
+    }
+
+  private:
+    std::vector<markov_counts> counts_;
+};
+
+/**
+ * Maps an observation distribution to its dense expected counts type.
+ */
+template <class ObsDist>
+struct dense_counts;
+
+template <>
+struct dense_counts<hmm::sequence_observations>
+{
+    using type = sequence_observation_counts;
+};
+}
+}
+#endif
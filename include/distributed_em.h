@@ -0,0 +1,215 @@
+/**
+ * @file distributed_em.h
+ * Data-parallel EM across processes. Each worker owns a shard of the
+ * training data and runs the E-step on it locally; a coordinator sums the
+ * workers' expected counts, runs the M-step, and sends the new parameters
+ * back out for the next iteration.
+ *
+ * The protocol, over one socket per worker, is:
+ *
+ *  1. the worker sends its rank and the number of instances in its shard;
+ *  2. for each iteration, the coordinator sends a run_estep command
+ *     followed by the frozen parameter groups, the trellis precision and
+ *     the current model, and the worker replies with its expected counts
+ *     (leaving out the frozen groups);
+ *  3. the coordinator sends a shutdown command when training is done, or
+ *     when it fails.
+ *
+ * Counts are summed in rank order, whatever order the workers connect in,
+ * so a run is reproducible as long as the shards, their ranks, and the
+ * per-worker thread counts do not change.
+ */
+
+#ifndef CLICKSTREAM_DISTRIBUTED_EM_H_
+#define CLICKSTREAM_DISTRIBUTED_EM_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "retrofit_hmm.h"
+#include "socket_stream.h"
+
+#include "meta/io/packed.h"
+#include "meta/logging/logger.h"
+#include "meta/parallel/thread_pool.h"
+#include "meta/util/progress.h"
+
+namespace meta
+{
+namespace sequence
+{
+namespace hmm
+{
+
+namespace detail
+{
+enum class em_command : uint64_t
+{
+    shutdown = 0,
+    run_estep = 1
+};
+}
+
+/**
+ * Serves E-steps over a shard of the training data to a coordinator
+ * until it tells us to shut down.
+ *
+ * @param shard This worker's training instances
+ * @param address The address of the coordinator
+ * @param rank This worker's position among the coordinator's workers,
+ * from 0 to one less than their number
+ * @param pool The thread pool to run forward-backward on
+ */
+template <class HMM>
+void run_em_worker(const typename HMM::training_data_type& shard,
+                   const std::string& address, uint64_t rank,
+                   parallel::thread_pool& pool)
+{
+    LOG(info) << "Connecting to coordinator at " << address << " as worker "
+              << rank << "..." << ENDLG;
+    net::socket_stream conn{net::connect_socket(address)};
+
+    io::packed::write(conn, rank);
+    io::packed::write(conn, static_cast<uint64_t>(shard.size()));
+    conn.flush();
+
+    for (uint64_t iter = 1;; ++iter)
+    {
+        uint64_t command;
+        io::packed::read(conn, command);
+        if (!conn)
+            throw net::socket_exception{"lost connection to coordinator"};
+        if (command == static_cast<uint64_t>(detail::em_command::shutdown))
+            break;
+
+        parameter_groups frozen;
+        bool single_precision;
+        frozen.load(conn);
+        io::packed::read(conn, single_precision);
+        HMM hmm{conn};
+        printing::progress progress{"> E-step " + std::to_string(iter) + ": ",
+                                    shard.size()};
+        auto counts = hmm.expectation(shard, pool, progress, frozen,
+                                      single_precision);
+
+        counts.save(conn);
+        conn.flush();
+        if (!conn)
+            throw net::socket_exception{"lost connection to coordinator"};
+    }
+
+    LOG(info) << "Coordinator finished training" << ENDLG;
+}
+
+/**
+ * Trains the model by coordinating num_workers workers, each of which
+ * connects to the given address.
+ *
+ * @param hmm The model to train (the initial parameters are broadcast
+ * to the workers on the first iteration)
+ * @param address The address to listen on
+ * @param num_workers The number of workers to wait for
+ * @param options The training options
+ * @param state The training state to resume from
+ * @return the log likelihood of the data
+ */
+template <class HMM>
+double run_em_coordinator(HMM& hmm, const std::string& address,
+                          uint64_t num_workers,
+                          typename HMM::training_options options,
+                          typename HMM::training_state& state)
+{
+    net::socket_listener listener{address};
+
+    LOG(info) << "Waiting for " << num_workers << " workers on " << address
+              << "..." << ENDLG;
+
+    // indexed by rank
+    std::vector<std::unique_ptr<net::socket_stream>> workers(num_workers);
+    std::vector<uint64_t> shard_sizes(num_workers);
+    uint64_t num_instances = 0;
+    for (uint64_t i = 0; i < num_workers; ++i)
+    {
+        auto conn = std::make_unique<net::socket_stream>(listener.accept());
+
+        uint64_t rank;
+        uint64_t size;
+        io::packed::read(*conn, rank);
+        io::packed::read(*conn, size);
+        if (!*conn)
+            throw net::socket_exception{"lost connection to a new worker"};
+        if (rank >= num_workers || workers[rank])
+        {
+            throw net::socket_exception{"worker connected with invalid or "
+                                        "duplicate rank "
+                                        + std::to_string(rank)};
+        }
+
+        workers[rank] = std::move(conn);
+        shard_sizes[rank] = size;
+        num_instances += size;
+
+        LOG(info) << "Worker " << rank << " connected with " << size
+                  << " instances" << ENDLG;
+    }
+
+    auto shutdown = [&]() {
+        for (auto& worker : workers)
+        {
+            io::packed::write(
+                *worker, static_cast<uint64_t>(detail::em_command::shutdown));
+            worker->flush();
+        }
+    };
+
+    auto estep = [&](printing::progress& progress) {
+        for (auto& worker : workers)
+        {
+            io::packed::write(
+                *worker,
+                static_cast<uint64_t>(detail::em_command::run_estep));
+            options.frozen.save(*worker);
+            io::packed::write(*worker, options.single_precision);
+            hmm.save(*worker);
+            worker->flush();
+        }
+
+        typename HMM::expected_counts counts{hmm, options.frozen};
+        uint64_t done = 0;
+        for (uint64_t i = 0; i < workers.size(); ++i)
+        {
+            typename HMM::expected_counts worker_counts;
+            worker_counts.load(*workers[i]);
+            if (!*workers[i])
+                throw net::socket_exception{"lost connection to worker "
+                                            + std::to_string(i)};
+            counts += worker_counts;
+
+            done += shard_sizes[i];
+            progress(done);
+        }
+        return counts;
+    };
+
+    double log_likelihood;
+    try
+    {
+        log_likelihood = hmm.fit_with(num_instances, options, state, estep);
+    }
+    catch (...)
+    {
+        // let the workers exit rather than wait for a command that will
+        // never come; a worker whose connection is already gone just fails
+        // its write
+        shutdown();
+        throw;
+    }
+    shutdown();
+
+    return log_likelihood;
+}
+}
+}
+}
+#endif
@@ -0,0 +1,444 @@
+/**
+ * @file higher_order_markov_model.h
+ * An n-th order Markov model over a small alphabet of actions, with
+ * interpolated backoff to lower orders.
+ */
+
+#ifndef CLICKSTREAM_HIGHER_ORDER_MARKOV_MODEL_H_
+#define CLICKSTREAM_HIGHER_ORDER_MARKOV_MODEL_H_
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "meta/hashing/probe_map.h"
+#include "meta/io/packed.h"
+#include "meta/stats/dirichlet.h"
+#include "meta/util/identifiers.h"
+#include "meta/util/traits.h"
+
+namespace meta
+{
+namespace sequence
+{
+
+class higher_order_markov_model_exception : public std::runtime_error
+{
+  public:
+    using std::runtime_error::runtime_error;
+};
+
+namespace detail
+{
+/**
+ * Packs the contexts of a model into integer keys. The key of the empty
+ * context is 1, and the key of a context is the key of the context one
+ * shorter (dropping its oldest action) times the base, plus that oldest
+ * action. Actions before the start of a sequence are a distinct start
+ * symbol, and the leading 1 keeps contexts of different lengths apart.
+ */
+class context_packer
+{
+  public:
+    context_packer(uint64_t num_actions, uint64_t order)
+        : base_{num_actions + 1}, order_{order}
+    {
+        // the longest context must fit in a key
+        auto max_key = std::numeric_limits<uint64_t>::max();
+        for (uint64_t k = 0; k < order; ++k)
+        {
+            if (max_key / base_ < 1)
+                throw higher_order_markov_model_exception{
+                    "model order too large for the number of actions"};
+            max_key /= base_;
+        }
+    }
+
+    uint64_t start_symbol() const
+    {
+        return base_ - 1;
+    }
+
+    /**
+     * Computes the keys of every suffix of the history, from the empty
+     * context (keys[0]) to the full context (keys[order]).
+     *
+     * @param history The previous order actions, most recent last
+     */
+    void keys(const std::vector<uint64_t>& history,
+              std::vector<uint64_t>& keys) const
+    {
+        keys.resize(order_ + 1);
+        keys[0] = 1;
+        for (uint64_t k = 1; k <= order_; ++k)
+            keys[k] = keys[k - 1] * base_ + history[order_ - k];
+    }
+
+    /**
+     * @return the key of the context one action shorter
+     */
+    uint64_t parent(uint64_t key) const
+    {
+        return key / base_;
+    }
+
+    /**
+     * @return the number of actions in the context
+     */
+    uint64_t length(uint64_t key) const
+    {
+        uint64_t length = 0;
+        for (; key > 1; key /= base_)
+            ++length;
+        return length;
+    }
+
+    /**
+     * @return the actions in the context, oldest first, with the start
+     * symbol for positions before the start of the sequence
+     */
+    std::vector<uint64_t> unpack(uint64_t key) const
+    {
+        std::vector<uint64_t> context;
+        for (; key > 1; key /= base_)
+            context.push_back(key % base_);
+        return context;
+    }
+
+    /**
+     * Shifts an action into the history.
+     */
+    void push(std::vector<uint64_t>& history, uint64_t action) const
+    {
+        if (order_ == 0)
+            return;
+        for (uint64_t k = 1; k < order_; ++k)
+            history[k - 1] = history[k];
+        history[order_ - 1] = action;
+    }
+
+    uint64_t order() const
+    {
+        return order_;
+    }
+
+  private:
+    uint64_t base_;
+    uint64_t order_;
+};
+
+/**
+ * A table of dense rows of num_actions values, keyed by packed contexts.
+ * An open-addressing hash table maps each key to its row, and the rows
+ * are stored contiguously.
+ */
+class context_table
+{
+  public:
+    context_table(uint64_t num_actions = 0) : num_actions_{num_actions}
+    {
+        // nothing
+    }
+
+    /**
+     * @return the row for the key, creating it (zeroed) if needed
+     */
+    double* row(uint64_t key)
+    {
+        auto it = index_.find(key);
+        if (it != index_.end())
+            return &values_[it->value() * num_actions_];
+
+        index_[key] = keys_.size();
+        keys_.push_back(key);
+        values_.resize(values_.size() + num_actions_);
+        return &values_[values_.size() - num_actions_];
+    }
+
+    /**
+     * Reserves space for rows, so that pointers to rows stay valid while
+     * up to that many rows are created.
+     */
+    void reserve(uint64_t num_rows)
+    {
+        keys_.reserve(num_rows);
+        values_.reserve(num_rows * num_actions_);
+    }
+
+    /**
+     * @return the row for the key, or nullptr if there is none
+     */
+    const double* find(uint64_t key) const
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return nullptr;
+        return &values_[it->value() * num_actions_];
+    }
+
+    const std::vector<uint64_t>& keys() const
+    {
+        return keys_;
+    }
+
+    uint64_t num_actions() const
+    {
+        return num_actions_;
+    }
+
+  private:
+    uint64_t num_actions_;
+    hashing::probe_map<uint64_t, uint64_t> index_;
+    std::vector<uint64_t> keys_;
+    std::vector<double> values_;
+};
+}
+
+/**
+ * An order-n Markov model: the probability of each action depends on the
+ * n actions before it (the start of a session counts as a distinct
+ * symbol, so the first actions have their own distributions).
+ *
+ * Each context's distribution is smoothed by interpolating with the
+ * distribution of the context one action shorter:
+ *
+ *     p(a | h) = (c(h, a) + alpha * p(a | h')) / (c(h) + alpha),
+ *
+ * where h' is h without its oldest action and alpha is the total
+ * pseudo-count of the Dirichlet prior. The empty context backs off to the
+ * prior's mean, so an order-0 model is the usual Dirichlet posterior mean.
+ */
+class higher_order_markov_model
+{
+  public:
+    /**
+     * Expected counts of each action after each observed context (and
+     * all of its suffixes).
+     */
+    class expected_counts_type
+    {
+      public:
+        expected_counts_type(uint64_t num_actions, uint64_t order,
+                             stats::dirichlet<state_id> prior)
+            : packer_{num_actions, order},
+              counts_{num_actions},
+              prior_{std::move(prior)}
+        {
+            // nothing
+        }
+
+        void increment(const std::vector<state_id>& seq, double amount)
+        {
+            std::vector<uint64_t> history(packer_.order(),
+                                          packer_.start_symbol());
+            std::vector<uint64_t> keys;
+            for (const auto& action : seq)
+            {
+                packer_.keys(history, keys);
+                for (const auto& key : keys)
+                    counts_.row(key)[action] += amount;
+                packer_.push(history, action);
+            }
+        }
+
+        expected_counts_type& operator+=(const expected_counts_type& other)
+        {
+            for (const auto& key : other.counts_.keys())
+            {
+                auto row = counts_.row(key);
+                auto other_row = other.counts_.find(key);
+                for (uint64_t a = 0; a < counts_.num_actions(); ++a)
+                    row[a] += other_row[a];
+            }
+            return *this;
+        }
+
+      private:
+        friend higher_order_markov_model;
+
+        detail::context_packer packer_;
+        detail::context_table counts_;
+        stats::dirichlet<state_id> prior_;
+    };
+
+    /**
+     * Estimates the model from expected counts.
+     */
+    higher_order_markov_model(expected_counts_type&& counts)
+        : packer_{counts.packer_},
+          probs_{counts.counts_.num_actions()},
+          base_(counts.counts_.num_actions())
+    {
+        auto num_actions = counts.counts_.num_actions();
+        alpha_ = counts.prior_.pseudo_counts();
+        for (state_id a{0}; a < num_actions; ++a)
+            base_[a] = counts.prior_.pseudo_counts(a) / alpha_;
+
+        // estimate shorter contexts first, since longer ones back off to
+        // them (and reserve, since those rows are read while others are
+        // created)
+        probs_.reserve(counts.counts_.keys().size());
+        std::vector<std::vector<uint64_t>> levels(packer_.order() + 1);
+        for (const auto& key : counts.counts_.keys())
+            levels[packer_.length(key)].push_back(key);
+
+        for (const auto& level : levels)
+        {
+            for (const auto& key : level)
+            {
+                const double* backoff = key == 1
+                                            ? base_.data()
+                                            : probs_.find(packer_.parent(key));
+                const double* count = counts.counts_.find(key);
+                double total = 0;
+                for (uint64_t a = 0; a < num_actions; ++a)
+                    total += count[a];
+
+                double* row = probs_.row(key);
+                for (uint64_t a = 0; a < num_actions; ++a)
+                    row[a] = (count[a] + alpha_ * backoff[a])
+                             / (total + alpha_);
+            }
+        }
+    }
+
+    /**
+     * Loads a model written by save().
+     */
+    template <class InputStream,
+              class = util::disable_if_same_or_derived_t<
+                  higher_order_markov_model, InputStream>>
+    higher_order_markov_model(InputStream& is)
+        : packer_{read_packer(is)}, probs_{base_size(packer_)}
+    {
+        uint64_t num_contexts;
+        io::packed::read(is, alpha_);
+        base_.resize(probs_.num_actions());
+        for (auto& prob : base_)
+            io::packed::read(is, prob);
+
+        io::packed::read(is, num_contexts);
+        for (uint64_t i = 0; i < num_contexts; ++i)
+        {
+            uint64_t key;
+            io::packed::read(is, key);
+            double* row = probs_.row(key);
+            for (uint64_t a = 0; a < probs_.num_actions(); ++a)
+                io::packed::read(is, row[a]);
+        }
+    }
+
+    template <class OutputStream>
+    void save(OutputStream& os) const
+    {
+        io::packed::write(os, num_actions());
+        io::packed::write(os, order());
+        io::packed::write(os, alpha_);
+        for (const auto& prob : base_)
+            io::packed::write(os, prob);
+
+        io::packed::write(os, static_cast<uint64_t>(probs_.keys().size()));
+        for (const auto& key : probs_.keys())
+        {
+            io::packed::write(os, key);
+            const double* row = probs_.find(key);
+            for (uint64_t a = 0; a < num_actions(); ++a)
+                io::packed::write(os, row[a]);
+        }
+    }
+
+    /**
+     * Scores a whole session.
+     * @return the log probability of the session
+     */
+    double log_probability(const std::vector<state_id>& seq) const
+    {
+        std::vector<uint64_t> history(order(), packer_.start_symbol());
+        std::vector<uint64_t> keys;
+        double log_prob = 0;
+        for (const auto& action : seq)
+        {
+            log_prob += std::log(distribution(history, keys)[action]);
+            packer_.push(history, action);
+        }
+        return log_prob;
+    }
+
+    /**
+     * @return the probability of each action after the context with the
+     * given key, or nullptr if the context was never observed
+     */
+    const double* context_distribution(uint64_t key) const
+    {
+        return probs_.find(key);
+    }
+
+    /**
+     * @return the keys of the observed contexts
+     */
+    const std::vector<uint64_t>& contexts() const
+    {
+        return probs_.keys();
+    }
+
+    /**
+     * @return the actions in a context, oldest first, where
+     * num_actions() is the start symbol
+     */
+    std::vector<uint64_t> unpack(uint64_t key) const
+    {
+        return packer_.unpack(key);
+    }
+
+    uint64_t num_actions() const
+    {
+        return probs_.num_actions();
+    }
+
+    uint64_t order() const
+    {
+        return packer_.order();
+    }
+
+  private:
+    /**
+     * The distribution after the given history: that of its longest
+     * observed suffix, which (having no counts of its own) is what every
+     * longer context would back off to.
+     */
+    const double* distribution(const std::vector<uint64_t>& history,
+                               std::vector<uint64_t>& keys) const
+    {
+        packer_.keys(history, keys);
+        for (auto k = keys.size(); k-- > 0;)
+        {
+            if (auto row = probs_.find(keys[k]))
+                return row;
+        }
+        return base_.data();
+    }
+
+    template <class InputStream>
+    static detail::context_packer read_packer(InputStream& is)
+    {
+        uint64_t num_actions;
+        uint64_t order;
+        io::packed::read(is, num_actions);
+        io::packed::read(is, order);
+        return {num_actions, order};
+    }
+
+    static uint64_t base_size(const detail::context_packer& packer)
+    {
+        return packer.start_symbol();
+    }
+
+    detail::context_packer packer_;
+    detail::context_table probs_;
+    std::vector<double> base_;
+    double alpha_;
+};
+}
+}
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file json_records.h
+ * Reads lists of JSON records, such as the per-student output of decode,
+ * written either as a single JSON array or as line-delimited JSON (one
+ * record per line).
+ */
+
+#ifndef CLICKSTREAM_JSON_RECORDS_H_
+#define CLICKSTREAM_JSON_RECORDS_H_
+
+#include <algorithm>
+#include <cctype>
+#include <istream>
+#include <stdexcept>
+#include <string>
+
+#include "json.hpp"
+
+namespace meta
+{
+
+/**
+ * Calls fn on every record in the stream. The format is detected from
+ * the first non-whitespace character: '[' starts a single array, and
+ * anything else is read as one record per (non-empty) line, in which case
+ * only one record is in memory at a time.
+ */
+template <class Function>
+void for_each_json_record(std::istream& input, Function&& fn)
+{
+    input >> std::ws;
+    if (input.peek() == '[')
+    {
+        nlohmann::json records;
+        input >> records;
+        for (const auto& record : records)
+            fn(record);
+        return;
+    }
+
+    std::string line;
+    while (std::getline(input, line))
+    {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        fn(nlohmann::json::parse(line));
+    }
+}
+
+/**
+ * Picks one model's posteriors out of a record that decode wrote for
+ * several models (listed under "models"), adding the username. Records
+ * decoded against a single model are returned unchanged.
+ *
+ * @param record The decoded student
+ * @param model The model file as it was given to decode, or its position
+ * among decode's models; empty if only single-model records are expected
+ */
+inline nlohmann::json select_model(const nlohmann::json& record,
+                                   const std::string& model)
+{
+    auto models = record.find("models");
+    if (models == record.end())
+        return record;
+
+    if (model.empty())
+    {
+        throw std::invalid_argument{
+            "student was decoded against several models; choose one with "
+            "--model"};
+    }
+
+    bool is_index = std::all_of(model.begin(), model.end(), [](char c) {
+        return std::isdigit(static_cast<unsigned char>(c));
+    });
+    for (uint64_t m = 0; m < models->size(); ++m)
+    {
+        const auto& result = (*models)[m];
+        if ((is_index && std::stoull(model) == m)
+            || result["model"].get<std::string>() == model)
+        {
+            auto selected = result;
+            selected["username"] = record["username"];
+            return selected;
+        }
+    }
+    throw std::invalid_argument{"student was not decoded against model "
+                                + model};
+}
+
+/**
+ * Reads every record from the stream into a JSON array.
+ */
+inline nlohmann::json read_json_records(std::istream& input)
+{
+    auto records = nlohmann::json::array();
+    for_each_json_record(input, [&](const nlohmann::json& record) {
+        records.push_back(record);
+    });
+    return records;
+}
+}
+#endif
@@ -0,0 +1,158 @@
+/**
+ * @file kendall_tau.h
+ * Kendall's tau_b and the normalized distance-based performance measure
+ * (NDPM) between two rankings, in O(n log n) time using Knight's
+ * algorithm.
+ */
+
+#ifndef CLICKSTREAM_KENDALL_TAU_H_
+#define CLICKSTREAM_KENDALL_TAU_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+namespace meta
+{
+
+/**
+ * Rank correlation statistics between a candidate ranking and a
+ * reference ranking.
+ */
+struct rank_statistics
+{
+    double tau_b;
+    double ndpm;
+};
+
+/**
+ * Computes rank_statistics for pairs of score arrays. The scratch buffers
+ * are kept between calls, so after the first call of a given size no
+ * further allocation takes place; use one rank_correlator per thread.
+ */
+class rank_correlator
+{
+  public:
+    /**
+     * @param x The candidate scores
+     * @param y The reference scores
+     * @param n The number of items
+     */
+    rank_statistics operator()(const double* x, const double* y, uint64_t n)
+    {
+        order_.resize(n);
+        std::iota(order_.begin(), order_.end(), 0);
+        std::sort(order_.begin(), order_.end(), [&](uint64_t a, uint64_t b) {
+            return x[a] < x[b] || (x[a] == x[b] && y[a] < y[b]);
+        });
+
+        ys_.resize(n);
+        for (uint64_t k = 0; k < n; ++k)
+            ys_[k] = y[order_[k]];
+
+        // pairs tied in x, and pairs tied in both x and y (which are
+        // adjacent, since ties in x are sorted by y)
+        uint64_t x_ties = 0;
+        uint64_t joint_ties = 0;
+        for (uint64_t k = 0; k < n;)
+        {
+            auto end = k;
+            while (end < n && x[order_[end]] == x[order_[k]])
+                ++end;
+            x_ties += pairs(end - k);
+
+            for (auto m = k; m < end;)
+            {
+                auto l = m;
+                while (l < end && ys_[l] == ys_[m])
+                    ++l;
+                joint_ties += pairs(l - m);
+                m = l;
+            }
+            k = end;
+        }
+
+        // the discordant pairs are the inversions in y when ordered by x
+        auto discordant = merge_sort(n);
+
+        uint64_t y_ties = 0;
+        for (uint64_t k = 0; k < n;)
+        {
+            auto end = k;
+            while (end < n && ys_[end] == ys_[k])
+                ++end;
+            y_ties += pairs(end - k);
+            k = end;
+        }
+
+        auto total = static_cast<double>(pairs(n));
+        auto numerator = total - static_cast<double>(x_ties)
+                         - static_cast<double>(y_ties)
+                         + static_cast<double>(joint_ties)
+                         - 2.0 * static_cast<double>(discordant);
+
+        rank_statistics stats;
+        stats.tau_b = numerator / std::sqrt((total - x_ties)
+                                            * (total - y_ties));
+
+        // NDPM counts a contradicted reference order twice and an order
+        // the candidate ties once, relative to all reference orders
+        stats.ndpm = (2.0 * discordant + (x_ties - joint_ties))
+                     / (2.0 * (total - y_ties));
+        return stats;
+    }
+
+  private:
+    static uint64_t pairs(uint64_t n)
+    {
+        return n * (n - 1) / 2;
+    }
+
+    /**
+     * Sorts ys_ with a bottom-up merge sort.
+     * @return the number of inversions (strictly decreasing pairs)
+     */
+    uint64_t merge_sort(uint64_t n)
+    {
+        buffer_.resize(n);
+        uint64_t inversions = 0;
+        for (uint64_t width = 1; width < n; width *= 2)
+        {
+            for (uint64_t lo = 0; lo < n; lo += 2 * width)
+            {
+                auto mid = std::min(lo + width, n);
+                auto hi = std::min(lo + 2 * width, n);
+                auto i = lo;
+                auto j = mid;
+                auto k = lo;
+                while (i < mid && j < hi)
+                {
+                    if (ys_[j] < ys_[i])
+                    {
+                        inversions += mid - i;
+                        buffer_[k++] = ys_[j++];
+                    }
+                    else
+                    {
+                        buffer_[k++] = ys_[i++];
+                    }
+                }
+                k = std::copy(ys_.begin() + i, ys_.begin() + mid,
+                              buffer_.begin() + k)
+                    - buffer_.begin();
+                std::copy(ys_.begin() + j, ys_.begin() + hi,
+                          buffer_.begin() + k);
+            }
+            std::swap(ys_, buffer_);
+        }
+        return inversions;
+    }
+
+    std::vector<uint64_t> order_;
+    std::vector<double> ys_;
+    std::vector<double> buffer_;
+};
+}
+#endif
@@ -0,0 +1,523 @@
+/**
+ * @file metrics.h
+ * Process-wide metrics shared by every executable: named counters, stage
+ * timers, memory use, and CPU time per thread, written as JSON.
+ *
+ * Each executable creates a metrics::session at the top of main. If the
+ * CLICKSTREAM_METRICS environment variable names a file, the metrics are
+ * written there when the session ends, and also every
+ * CLICKSTREAM_METRICS_INTERVAL seconds if that is set. Each write replaces
+ * the file atomically, so it can be polled while the program runs.
+ *
+ * Threads that exit before the report (thread pool workers, usually) are
+ * only in it if they were tracked: see track_threads().
+ */
+
+#ifndef CLICKSTREAM_METRICS_H_
+#define CLICKSTREAM_METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "json.hpp"
+
+namespace meta
+{
+namespace metrics
+{
+
+/**
+ * A monotonically increasing count of records, bytes, errors, etc. Safe
+ * to increment from any thread.
+ */
+class counter
+{
+  public:
+    counter& operator+=(uint64_t amount)
+    {
+        value_.fetch_add(amount, std::memory_order_relaxed);
+        return *this;
+    }
+
+    counter& operator++()
+    {
+        return *this += 1;
+    }
+
+    uint64_t value() const
+    {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> value_{0};
+};
+
+/**
+ * The total time spent in a named stage, and the number of times it was
+ * entered. Safe to update from any thread; if several threads are in the
+ * stage at once, their times add up.
+ */
+class stage
+{
+  public:
+    void add(std::chrono::nanoseconds elapsed)
+    {
+        nanoseconds_.fetch_add(static_cast<uint64_t>(elapsed.count()),
+                               std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    double seconds() const
+    {
+        return nanoseconds_.load(std::memory_order_relaxed) / 1e9;
+    }
+
+    uint64_t count() const
+    {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> nanoseconds_{0};
+    std::atomic<uint64_t> count_{0};
+};
+
+/**
+ * Every counter and stage in the process. Looking one up takes a lock, so
+ * code on a hot path should look it up once and keep the reference,
+ * which stays valid for the life of the process.
+ */
+class registry
+{
+  public:
+    static registry& global()
+    {
+        static registry reg;
+        return reg;
+    }
+
+    metrics::counter& counter(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto& ptr = counters_[name];
+        if (!ptr)
+            ptr = std::make_unique<metrics::counter>();
+        return *ptr;
+    }
+
+    metrics::stage& stage(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto& ptr = stages_[name];
+        if (!ptr)
+            ptr = std::make_unique<metrics::stage>();
+        return *ptr;
+    }
+
+    nlohmann::json counters_json() const
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto obj = nlohmann::json::object();
+        for (const auto& pr : counters_)
+            obj[pr.first] = pr.second->value();
+        return obj;
+    }
+
+    /**
+     * Records the CPU time of a thread that is about to exit.
+     */
+    void thread_exited(nlohmann::json thread)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        exited_threads_.push_back(std::move(thread));
+    }
+
+    nlohmann::json exited_threads_json() const
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return exited_threads_;
+    }
+
+    nlohmann::json stages_json() const
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto obj = nlohmann::json::object();
+        for (const auto& pr : stages_)
+        {
+            obj[pr.first] = {{"seconds", pr.second->seconds()},
+                             {"count", pr.second->count()}};
+        }
+        return obj;
+    }
+
+  private:
+    registry() = default;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<metrics::counter>> counters_;
+    std::map<std::string, std::unique_ptr<metrics::stage>> stages_;
+    std::vector<nlohmann::json> exited_threads_;
+};
+
+/**
+ * @return the global counter with the given name
+ */
+inline counter& get_counter(const std::string& name)
+{
+    return registry::global().counter(name);
+}
+
+/**
+ * @return the global stage with the given name
+ */
+inline stage& get_stage(const std::string& name)
+{
+    return registry::global().stage(name);
+}
+
+/**
+ * Adds the time between its construction and destruction (or the call to
+ * stop()) to a stage.
+ */
+class stage_timer
+{
+  public:
+    stage_timer(metrics::stage& stg)
+        : stage_(stg), start_{std::chrono::steady_clock::now()}
+    {
+        // nothing
+    }
+
+    stage_timer(const std::string& name) : stage_timer(get_stage(name))
+    {
+        // nothing
+    }
+
+    stage_timer(const stage_timer&) = delete;
+    stage_timer& operator=(const stage_timer&) = delete;
+
+    ~stage_timer()
+    {
+        stop();
+    }
+
+    void stop()
+    {
+        if (stopped_)
+            return;
+        stage_.add(std::chrono::steady_clock::now() - start_);
+        stopped_ = true;
+    }
+
+  private:
+    metrics::stage& stage_;
+    std::chrono::steady_clock::time_point start_;
+    bool stopped_ = false;
+};
+
+namespace detail
+{
+inline double timeval_seconds(const timeval& tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Reads the CPU time of one thread from its /proc stat file.
+ * @return null if the file could not be read
+ */
+inline nlohmann::json thread_json(const std::string& stat_path)
+{
+    std::ifstream input{stat_path};
+    std::string stat{std::istreambuf_iterator<char>{input},
+                     std::istreambuf_iterator<char>{}};
+
+    // the name is in parentheses and may contain spaces; utime and stime
+    // are the 12th and 13th fields after it
+    auto open = stat.find('(');
+    auto close = stat.rfind(')');
+    if (open == std::string::npos || close == std::string::npos)
+        return nullptr;
+
+    std::istringstream fields{stat.substr(close + 2)};
+    std::string field;
+    for (int i = 0; i < 11; ++i)
+        fields >> field;
+    uint64_t utime = 0;
+    uint64_t stime = 0;
+    fields >> utime >> stime;
+
+    const double ticks = sysconf(_SC_CLK_TCK);
+    return {{"tid", std::stoull(stat.substr(0, open))},
+            {"name", stat.substr(open + 1, close - open - 1)},
+            {"user_seconds", utime / ticks},
+            {"system_seconds", stime / ticks}};
+}
+
+/**
+ * Reads the CPU time of each live thread of this process from
+ * /proc/self/task, along with the times recorded by tracked threads that
+ * have since exited.
+ */
+inline nlohmann::json threads_json()
+{
+    // a tracked thread is still listed for a moment after recording its
+    // time, so the live reading replaces the recorded one
+    std::map<uint64_t, nlohmann::json> threads;
+    for (auto& thread : registry::global().exited_threads_json())
+    {
+        auto tid = thread["tid"].get<uint64_t>();
+        threads[tid] = std::move(thread);
+    }
+
+    if (auto dir = opendir("/proc/self/task"))
+    {
+        while (auto entry = readdir(dir))
+        {
+            std::string tid = entry->d_name;
+            if (tid == "." || tid == "..")
+                continue;
+
+            auto thread = thread_json("/proc/self/task/" + tid + "/stat");
+            if (!thread.is_null())
+                threads[std::stoull(tid)] = std::move(thread);
+        }
+        closedir(dir);
+    }
+
+    auto arr = nlohmann::json::array();
+    for (auto& pr : threads)
+        arr.push_back(std::move(pr.second));
+    return arr;
+}
+
+/**
+ * Records the CPU time of the thread that owns it when the thread exits.
+ */
+struct thread_tracker
+{
+    ~thread_tracker()
+    {
+        auto thread = thread_json("/proc/thread-self/stat");
+        if (thread.is_null())
+            return;
+        thread["exited"] = true;
+        registry::global().thread_exited(std::move(thread));
+    }
+};
+
+/**
+ * @return the current resident set size in KB
+ */
+inline uint64_t current_rss_kb()
+{
+    std::ifstream statm{"/proc/self/statm"};
+    uint64_t size = 0;
+    uint64_t resident = 0;
+    statm >> size >> resident;
+    return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) / 1024;
+}
+}
+
+/**
+ * Records the CPU time of the calling thread when it exits, so that it is
+ * still reported if the thread is gone by the time the report is written.
+ */
+inline void track_thread()
+{
+    static thread_local detail::thread_tracker tracker;
+    (void)tracker;
+}
+
+/**
+ * Calls track_thread() on every thread of a thread pool. Each thread takes
+ * one task and holds it until all of them have, so none can take two.
+ */
+template <class ThreadPool>
+void track_threads(ThreadPool& pool)
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    uint64_t arrived = 0;
+    const uint64_t size = pool.size();
+
+    std::vector<std::future<void>> futures;
+    for (uint64_t i = 0; i < size; ++i)
+    {
+        futures.push_back(pool.submit_task([&]() {
+            track_thread();
+            std::unique_lock<std::mutex> lock{mutex};
+            if (++arrived == size)
+                cond.notify_all();
+            else
+                cond.wait(lock, [&]() { return arrived == size; });
+        }));
+    }
+    for (auto& fut : futures)
+        fut.get();
+}
+
+/**
+ * The metrics for the lifetime of one executable. Only one should exist
+ * at a time.
+ */
+class session
+{
+  public:
+    /**
+     * @param program The name of the executable, for the report
+     */
+    session(std::string program)
+        : program_{std::move(program)},
+          start_{std::chrono::steady_clock::now()}
+    {
+        if (auto file = std::getenv("CLICKSTREAM_METRICS"))
+            filename_ = file;
+
+        auto interval = std::getenv("CLICKSTREAM_METRICS_INTERVAL");
+        if (filename_.empty() || !interval)
+            return;
+
+        // a bad value only turns the periodic dumps off; the metrics must
+        // never stop the program from running
+        char* end;
+        auto seconds = std::strtod(interval, &end);
+        // far larger periods overflow the wait below, and 1e7 s is already
+        // over a hundred days
+        if (end == interval || *end != '\0' || !(seconds >= 0)
+            || seconds > 1e7)
+        {
+            std::cerr << "Ignoring CLICKSTREAM_METRICS_INTERVAL=" << interval
+                      << ": expected a number of seconds up to 1e7"
+                      << std::endl;
+            return;
+        }
+        if (seconds == 0)
+            return;
+
+        dumper_ = std::thread{[this, seconds]() {
+            std::unique_lock<std::mutex> lock{mutex_};
+            auto period = std::chrono::duration<double>{seconds};
+            while (!cond_.wait_for(lock, period, [&]() { return done_; }))
+            {
+                // a failed write must not take the program down with it;
+                // the next one may succeed
+                try
+                {
+                    write();
+                }
+                catch (const std::exception& ex)
+                {
+                    std::cerr << "Failed to write metrics: " << ex.what()
+                              << std::endl;
+                }
+            }
+        }};
+    }
+
+    session(const session&) = delete;
+    session& operator=(const session&) = delete;
+
+    ~session()
+    {
+        if (dumper_.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                done_ = true;
+            }
+            cond_.notify_one();
+            dumper_.join();
+        }
+
+        try
+        {
+            write();
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "Failed to write metrics: " << ex.what()
+                      << std::endl;
+        }
+    }
+
+    /**
+     * @return a snapshot of every metric
+     */
+    nlohmann::json to_json() const
+    {
+        auto wall = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_);
+
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        auto& reg = registry::global();
+        return {{"program", program_},
+                {"pid", static_cast<uint64_t>(getpid())},
+                {"wall_seconds", wall.count()},
+                {"user_seconds", detail::timeval_seconds(usage.ru_utime)},
+                {"system_seconds", detail::timeval_seconds(usage.ru_stime)},
+                {"peak_rss_kb", static_cast<uint64_t>(usage.ru_maxrss)},
+                {"rss_kb", detail::current_rss_kb()},
+                {"stages", reg.stages_json()},
+                {"counters", reg.counters_json()},
+                {"threads", detail::threads_json()}};
+    }
+
+  private:
+    void write() const
+    {
+        if (filename_.empty())
+            return;
+
+        auto tmp = filename_ + ".tmp";
+        {
+            std::ofstream output{tmp};
+            output << to_json().dump(2) << "\n";
+            output.close();
+            if (!output)
+                throw std::runtime_error{"could not write " + tmp};
+        }
+        if (std::rename(tmp.c_str(), filename_.c_str()) != 0)
+        {
+            throw std::runtime_error{"could not rename " + tmp + " to "
+                                     + filename_ + ": "
+                                     + std::strerror(errno)};
+        }
+    }
+
+    std::string program_;
+    std::string filename_;
+    std::chrono::steady_clock::time_point start_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool done_ = false;
+    std::thread dumper_;
+};
+}
+}
+#endif
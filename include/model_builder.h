@@ -0,0 +1,109 @@
+/**
+ * @file model_builder.h
+ * Helpers for constructing models directly from their parameters rather
+ * than estimating them from expected counts. This is useful when editing
+ * an existing model (e.g., splitting one of its states).
+ */
+
+#ifndef CLICKSTREAM_MODEL_BUILDER_H_
+#define CLICKSTREAM_MODEL_BUILDER_H_
+
+#include <sstream>
+#include <vector>
+
+#include "meta/io/packed.h"
+#include "meta/sequence/hmm/sequence_observations.h"
+#include "meta/sequence/markov_model.h"
+#include "meta/stats/dirichlet.h"
+#include "meta/stats/multinomial.h"
+
+namespace meta
+{
+namespace sequence
+{
+
+/**
+ * Constructs a Markov model with the given initial and transition
+ * probabilities. The probabilities are used as pseudo-counts, so the
+ * resulting model also incorporates the (tiny) smoothing prior.
+ *
+ * @param init The initial state probabilities
+ * @param trans The transition probabilities; trans[i][j] = p(j | i)
+ * @param prior The Dirichlet prior to smooth with
+ */
+inline markov_model
+make_markov_model(const std::vector<double>& init,
+                  const std::vector<std::vector<double>>& trans,
+                  stats::dirichlet<state_id> prior)
+{
+    markov_model::expected_counts_type counts{init.size(), std::move(prior)};
+    for (state_id i{0}; i < init.size(); ++i)
+    {
+        counts.increment_initial(i, init[i]);
+        for (state_id j{0}; j < init.size(); ++j)
+            counts.increment_transition(i, j, trans[i][j]);
+    }
+    return markov_model{std::move(counts)};
+}
+
+/**
+ * Constructs a Markov model with exactly the initial state distribution
+ * of one model and the transition distributions of another. markov_model
+ * has no way to set either directly, so we splice their serialized forms,
+ * which hold the initial state distribution followed by the transition
+ * distributions.
+ */
+inline markov_model splice_markov_models(const markov_model& initial,
+                                         const markov_model& transitions)
+{
+    std::stringstream initial_ss;
+    std::stringstream transitions_ss;
+    initial.save(initial_ss);
+    transitions.save(transitions_ss);
+
+    // read past the initial state distribution of each to find where it
+    // ends
+    stats::multinomial<state_id> skipped;
+    skipped.load(initial_ss);
+    skipped.load(transitions_ss);
+    auto initial_end = static_cast<std::size_t>(initial_ss.tellg());
+    auto transitions_start = static_cast<std::size_t>(transitions_ss.tellg());
+
+    std::stringstream ss;
+    ss << initial_ss.str().substr(0, initial_end)
+       << transitions_ss.str().substr(transitions_start);
+    return markov_model{ss};
+}
+
+/**
+ * Constructs a sequence observation distribution out of one Markov model
+ * per hidden state. sequence_observations has no public constructor for
+ * this, so we round-trip through its serialized form: the number of
+ * states followed by each of the models.
+ */
+inline hmm::sequence_observations
+make_sequence_observations(const std::vector<markov_model>& models)
+{
+    std::stringstream ss;
+    io::packed::write(ss, static_cast<uint64_t>(models.size()));
+    for (const auto& mm : models)
+        mm.save(ss);
+    return hmm::sequence_observations{ss};
+}
+
+/**
+ * Constructs a hidden Markov model out of an observation distribution and
+ * a Markov model over its hidden states, again by way of its serialized
+ * form.
+ */
+template <class HMM, class ObsDist>
+HMM make_hmm(const ObsDist& obs_dist, const markov_model& trans)
+{
+    std::stringstream ss;
+    obs_dist.save(ss);
+    trans.save(ss);
+    return HMM{ss};
+}
+}
+}
+#endif
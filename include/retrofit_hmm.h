@@ -10,16 +10,29 @@
 #ifndef META_SEQUENCE_HMM_H_
 #define META_SEQUENCE_HMM_H_
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "dense_counts.h"
+#include "metrics.h"
 
 #include "meta/config.h"
+#include "meta/io/gzstream.h"
+#include "meta/io/packed.h"
 #include "meta/logging/logger.h"
 #include "meta/parallel/algorithm.h"
-#include "meta/sequence/hmm/forward_backward.h"
 #include "meta/sequence/markov_model.h"
-#include "meta/sequence/trellis.h"
 #include "meta/stats/multinomial.h"
 #include "meta/util/identifiers.h"
+#include "meta/util/optional.h"
 #include "meta/util/progress.h"
 #include "meta/util/random.h"
 #include "meta/util/time.h"
@@ -44,7 +57,34 @@ struct hmm_traits
     using observation_type = typename ObsDist::observation_type;
     using sequence_type = std::vector<observation_type>;
     using training_data_type = std::vector<sequence_type>;
-    using forward_backward_type = scaling_forward_backward;
+    using obs_counts_type = typename dense_counts<ObsDist>::type;
+};
+
+/**
+ * A set of parameter groups of a hidden Markov model, e.g. the groups
+ * that are held fixed during training.
+ */
+struct parameter_groups
+{
+    bool initial = false;
+    bool transitions = false;
+    bool observations = false;
+
+    template <class OutputStream>
+    void save(OutputStream& os) const
+    {
+        io::packed::write(os, initial);
+        io::packed::write(os, transitions);
+        io::packed::write(os, observations);
+    }
+
+    template <class InputStream>
+    void load(InputStream& is)
+    {
+        io::packed::read(is, initial);
+        io::packed::read(is, transitions);
+        io::packed::read(is, observations);
+    }
 };
 
 /**
@@ -59,7 +99,7 @@ class hidden_markov_model
     using observation_type = typename traits_type::observation_type;
     using sequence_type = typename traits_type::sequence_type;
     using training_data_type = typename traits_type::training_data_type;
-    using forward_backward_type = typename traits_type::forward_backward_type;
+    using obs_counts_type = typename traits_type::obs_counts_type;
 
     struct training_options
     {
@@ -75,6 +115,226 @@ class hidden_markov_model
          * many iterations, stop training.
          */
         uint64_t max_iters = std::numeric_limits<uint64_t>::max();
+
+        /**
+         * The parameter groups to hold fixed (e.g., the observation
+         * distribution when retrofitting a model to a cohort). Expected
+         * counts for frozen groups are never accumulated.
+         */
+        parameter_groups frozen;
+
+        /**
+         * The file to write checkpoints to. Checkpoints are written to a
+         * temporary file and then renamed over this one, so a crash while
+         * writing never clobbers the last good checkpoint. Empty disables
+         * checkpointing.
+         */
+        std::string checkpoint_file;
+
+        /**
+         * The number of iterations between checkpoints.
+         */
+        uint64_t checkpoint_interval = 1;
+
+        /**
+         * The number of instances per mini-batch for online (stepwise) EM.
+         * The parameters are re-estimated after every mini-batch from
+         * running sufficient statistics, which are blended with the kth
+         * mini-batch's expected counts at rate
+         * (k + step_offset)^(-step_exponent). 0 uses ordinary batch EM.
+         */
+        uint64_t batch_size = 0;
+
+        /**
+         * The offset of the online EM step size schedule. Larger values
+         * damp the early updates.
+         */
+        double step_offset = 2.0;
+
+        /**
+         * The decay exponent of the online EM step size schedule. This
+         * must be in (0.5, 1] for online EM to converge.
+         */
+        double step_exponent = 0.7;
+
+        /**
+         * Whether to accelerate batch EM with SQUAREM extrapolation. Each
+         * iteration then takes two EM steps, extrapolates along the path
+         * they trace, and runs an E-step at the extrapolated parameters;
+         * if their likelihood is worse than after the first EM step, the
+         * extrapolation is discarded in favor of the plain EM steps. An
+         * iteration therefore costs up to three E-steps, but typically
+         * replaces many more.
+         */
+        bool accelerate = false;
+
+        /**
+         * Whether to store the forward-backward trellises in single
+         * precision. This halves their footprint and memory traffic; the
+         * scaling factors and log likelihood are still accumulated in
+         * double precision.
+         */
+        bool single_precision = false;
+    };
+
+    /**
+     * Temporary storage for expected counts for the different model types,
+     * plus the data log likelihood computed during the forward-backward
+     * algorithm. The counts are dense so that they can be scaled when
+     * blending mini-batch statistics in online EM. Counts for frozen
+     * parameter groups are left out entirely.
+    */
+    struct expected_counts
+    {
+        expected_counts() = default;
+
+        expected_counts(const hidden_markov_model& hmm,
+                        const parameter_groups& frozen = {})
+            : model_counts{hmm.model_, !frozen.initial, !frozen.transitions}
+        {
+            if (!frozen.observations)
+                obs_counts = obs_counts_type{hmm.obs_dist_};
+        }
+
+        expected_counts& operator+=(const expected_counts& other)
+        {
+            if (obs_counts)
+                *obs_counts += *other.obs_counts;
+            model_counts += other.model_counts;
+            log_likelihood += other.log_likelihood;
+            return *this;
+        }
+
+        /**
+         * Adds weight * other to these counts.
+         */
+        void add(const expected_counts& other, double weight)
+        {
+            if (obs_counts)
+                obs_counts->add(*other.obs_counts, weight);
+            model_counts.add(other.model_counts, weight);
+            log_likelihood += weight * other.log_likelihood;
+        }
+
+        /**
+         * @return the squared Euclidean norm of the counts
+         */
+        double sum_of_squares() const
+        {
+            auto sum = model_counts.sum_of_squares();
+            if (obs_counts)
+                sum += obs_counts->sum_of_squares();
+            return sum;
+        }
+
+        /**
+         * Raises any count below min_count to min_count.
+         */
+        void clamp(double min_count)
+        {
+            if (obs_counts)
+                obs_counts->clamp(min_count);
+            model_counts.clamp(min_count);
+        }
+
+        expected_counts& operator*=(double factor)
+        {
+            if (obs_counts)
+                *obs_counts *= factor;
+            model_counts *= factor;
+            log_likelihood *= factor;
+            return *this;
+        }
+
+        template <class OutputStream>
+        void save(OutputStream& os) const
+        {
+            io::packed::write(os, static_cast<bool>(obs_counts));
+            if (obs_counts)
+                obs_counts->save(os);
+            model_counts.save(os);
+            io::packed::write(os, log_likelihood);
+        }
+
+        template <class InputStream>
+        void load(InputStream& is)
+        {
+            bool has_obs_counts;
+            io::packed::read(is, has_obs_counts);
+            obs_counts = util::nullopt;
+            if (has_obs_counts)
+            {
+                obs_counts_type counts;
+                counts.load(is);
+                obs_counts = std::move(counts);
+            }
+            model_counts.load(is);
+            io::packed::read(is, log_likelihood);
+        }
+
+        util::optional<obs_counts_type> obs_counts;
+        markov_counts model_counts;
+        double log_likelihood = 0.0;
+    };
+
+    /**
+     * The state of the training loop that is needed (in addition to the
+     * model parameters) to resume training from a checkpoint.
+     */
+    struct training_state
+    {
+        /// The number of completed iterations
+        uint64_t iteration = 0;
+
+        /// The log likelihood computed in the last completed iteration
+        double log_likelihood = std::numeric_limits<double>::lowest();
+
+        /// The random number generator used during training
+        std::mt19937 rng;
+
+        /// The number of mini-batch updates made so far (online EM only)
+        uint64_t num_updates = 0;
+
+        /// The running sufficient statistics (online EM only)
+        util::optional<expected_counts> running_counts;
+
+        template <class OutputStream>
+        void save(OutputStream& os) const
+        {
+            std::ostringstream rng_state;
+            rng_state << rng;
+
+            io::packed::write(os, iteration);
+            io::packed::write(os, log_likelihood);
+            io::packed::write(os, rng_state.str());
+            io::packed::write(os, num_updates);
+            io::packed::write(os, static_cast<bool>(running_counts));
+            if (running_counts)
+                running_counts->save(os);
+        }
+
+        template <class InputStream>
+        void load(InputStream& is)
+        {
+            std::string rng_state;
+            bool has_running_counts;
+
+            io::packed::read(is, iteration);
+            io::packed::read(is, log_likelihood);
+            io::packed::read(is, rng_state);
+            io::packed::read(is, num_updates);
+            io::packed::read(is, has_running_counts);
+
+            std::istringstream{rng_state} >> rng;
+
+            running_counts = util::nullopt;
+            if (has_running_counts)
+            {
+                expected_counts counts;
+                counts.load(is);
+                running_counts = std::move(counts);
+            }
+        }
     };
 
     /**
@@ -143,45 +403,131 @@ class hidden_markov_model
     double fit(const training_data_type& instances, parallel::thread_pool& pool,
                training_options options)
     {
-        double old_ll = std::numeric_limits<double>::lowest();
-        for (uint64_t iter = 1; iter <= options.max_iters; ++iter)
-        {
-            double log_likelihood = 0;
+        training_state state;
+        return fit(instances, pool, options, state);
+    }
 
-            auto em_time = common::time([&]() {
-                printing::progress progress{"> Iteration "
-                                                + std::to_string(iter) + ": ",
-                                            instances.size()};
-                log_likelihood
-                    = expectation_maximization(instances, pool, progress);
-            });
+    /**
+     * Fits the model starting from the given training state, which is
+     * updated as training progresses. Resuming from a checkpoint with the
+     * same data and number of threads reproduces the uninterrupted run
+     * exactly.
+     *
+     * @param instances The training data to fit the model to
+     * @param options The training options
+     * @param state The training state to resume from
+     * @return the log likelihood of the data
+     */
+    double fit(const training_data_type& instances, parallel::thread_pool& pool,
+               training_options options, training_state& state)
+    {
+        if (options.batch_size > 0
+            && (options.step_exponent <= 0.5 || options.step_exponent > 1
+                || options.step_offset <= 0))
+        {
+            throw hmm_exception{"online EM requires a step exponent in (0.5, "
+                                "1] and a positive step offset"};
+        }
 
-            auto relative_change = (old_ll - log_likelihood) / old_ll;
-            LOG(info) << "Took " << em_time.count() / 1000.0 << "s" << ENDLG;
+        if (options.batch_size > 0 && options.accelerate)
+            throw hmm_exception{"online EM cannot be accelerated"};
 
-            if (iter > 1)
-            {
-                LOG(info) << "Log likelihood: " << log_likelihood << " (+"
-                          << relative_change << " relative change)" << ENDLG;
-            }
-            else
-            {
-                LOG(info) << "Log log_likelihood: " << log_likelihood << ENDLG;
-            }
+        auto pass = [&](printing::progress& progress) {
+            if (options.batch_size > 0)
+                return online_expectation_maximization(
+                    instances, pool, progress, options, state);
+            if (options.accelerate)
+                return accelerated_expectation_maximization(instances, pool,
+                                                            progress, options);
+            return expectation_maximization(instances, pool, progress, options);
+        };
+        return fit_passes(instances.size(), options, state, pass);
+    }
 
-            assert(old_ll <= log_likelihood);
+    /**
+     * Fits the model to instances that are streamed (e.g., from disk) in
+     * blocks on every iteration, so the whole training set never needs to
+     * be in memory at once. Only batch EM is supported.
+     *
+     * @param blocks The source of blocks of instances. It must provide
+     * rewind(), which starts a new pass over the data, and
+     * next(std::vector<sequence_type>&), which fetches the next block and
+     * returns false once the data is exhausted.
+     * @param num_instances The total number of instances in the data
+     * @param options The training options
+     * @param state The training state to resume from
+     * @return the log likelihood of the data
+     */
+    template <class BlockSource>
+    double fit_stream(BlockSource& blocks, uint64_t num_instances,
+                      parallel::thread_pool& pool, training_options options,
+                      training_state& state)
+    {
+        if (options.batch_size > 0)
+            throw hmm_exception{"online EM is not supported when streaming"};
 
-            if (iter > 1 && relative_change < options.delta)
-            {
-                LOG(info) << "Converged! (" << relative_change << " < "
-                          << options.delta << ")" << ENDLG;
-                return log_likelihood;
-            }
+        auto pass = [&](printing::progress& progress) {
+            return streaming_expectation_maximization(blocks, pool, progress,
+                                                      options);
+        };
+        return fit_passes(num_instances, options, state, pass);
+    }
 
-            old_ll = log_likelihood;
-        }
+    /**
+     * Fits the model using a custom E-step, such as one that is spread
+     * across several processes. The M-step, convergence check and
+     * checkpointing are the same as for fit().
+     *
+     * @param num_instances The total number of instances in the data
+     * @param options The training options
+     * @param state The training state to resume from
+     * @param estep Computes the expected counts under the current
+     * parameters, given a printing::progress over num_instances
+     * @return the log likelihood of the data
+     */
+    template <class EStep>
+    double fit_with(uint64_t num_instances, training_options options,
+                    training_state& state, EStep&& estep)
+    {
+        auto pass = [&](printing::progress& progress) {
+            auto counts = estep(progress);
+            maximization(counts);
+            return counts.log_likelihood;
+        };
+        return fit_passes(num_instances, options, state, pass);
+    }
 
-        return old_ll;
+    /**
+     * Computes the expected counts for the instances under the current
+     * parameters, running forward-backward in parallel on the pool.
+     *
+     * @param frozen The parameter groups to leave out of the counts
+     * @param single_precision Whether to store the trellises as float
+     */
+    expected_counts expectation(const training_data_type& instances,
+                                parallel::thread_pool& pool,
+                                printing::progress& progress,
+                                const parameter_groups& frozen = {},
+                                bool single_precision = false)
+    {
+        metrics::stage_timer timer{"em_expectation"};
+        metrics::get_counter("em_instances") += instances.size();
+        auto trans = transition_matrix();
+        uint64_t seq_id = 0;
+        std::mutex progress_mutex;
+        return parallel::reduction(
+            instances.begin(), instances.end(), pool,
+            [&]() { return expected_counts{*this, frozen}; },
+            [&](expected_counts& counts, const sequence_type& seq) {
+                {
+                    std::lock_guard<std::mutex> lock{progress_mutex};
+                    progress(seq_id++);
+                }
+                forward_backward(seq, trans, counts, single_precision);
+            },
+            [&](expected_counts& result, const expected_counts& temp) {
+                result += temp;
+            });
     }
 
     uint64_t num_states() const
@@ -218,35 +564,27 @@ class hidden_markov_model
     }
 
     /**
-     * Temporary storage for expected counts for the different model types,
-     * plus the data log likelihood computed during the forward-backward
-     * algorithm
-    */
-    struct expected_counts
+     * Atomically writes the model and training state to a checkpoint
+     * file. A checkpoint can be loaded by constructing a model from the
+     * (gzipped) file and then loading the training state from the
+     * remainder of the stream.
+     */
+    void save_checkpoint(const std::string& filename,
+                         const training_state& state) const
     {
-#if !META_HAS_PROMISE_WITH_NO_DEFAULT_CTOR
-        expected_counts() = default;
-#endif
-
-        expected_counts(const hidden_markov_model& hmm)
-            : obs_counts{hmm.obs_dist_.expected_counts()},
-              model_counts{hmm.model_.expected_counts()}
+        auto tmp_filename = filename + ".tmp";
         {
-            // nothing
+            io::gzofstream output{tmp_filename};
+            save(output);
+            state.save(output);
         }
 
-        expected_counts& operator+=(const expected_counts& other)
-        {
-            obs_counts += other.obs_counts;
-            model_counts += other.model_counts;
-            log_likelihood += other.log_likelihood;
-            return *this;
-        }
+        if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+            throw hmm_exception{"failed to write checkpoint " + filename};
 
-        typename ObsDist::expected_counts_type obs_counts;
-        markov_model::expected_counts_type model_counts;
-        double log_likelihood = 0.0;
-    };
+        LOG(info) << "Checkpointed iteration " << state.iteration << " to "
+                  << filename << ENDLG;
+    }
 
     /**
      * Computes expected counts using the forward-backward algorithm.
@@ -254,61 +592,644 @@ class hidden_markov_model
     expected_counts forward_backward(const sequence_type& seq)
     {
         expected_counts ec{*this};
-        forward_backward(seq, ec);
+        forward_backward(seq, transition_matrix(), ec, false);
         return ec;
     }
 
+    /**
+     * @return the transition probabilities as a dense, row-major
+     * num_states x num_states matrix, for use with forward_backward()
+     */
+    std::vector<double> transition_matrix() const
+    {
+        auto num_states = this->num_states();
+        std::vector<double> trans(num_states * num_states);
+        for (uint64_t i = 0; i < num_states; ++i)
+            for (uint64_t j = 0; j < num_states; ++j)
+                trans[i * num_states + j]
+                    = trans_prob(state_id{i}, state_id{j});
+        return trans;
+    }
+
+    /**
+     * Computes the output probabilities b_s(o_t) of seq as a row-major
+     * T x num_states matrix. Each time step is divided by its largest
+     * output probability so that long observations don't underflow; the
+     * factors cancel out of the posteriors.
+     *
+     * @param output Where to store the (scaled) output probabilities
+     * @return the sum of the logs of the factors divided out, which is
+     * part of the log likelihood of seq
+     */
+    template <class Real>
+    double output_probabilities(const sequence_type& seq,
+                                std::vector<Real>& output) const
+    {
+        auto num_states = this->num_states();
+        output.resize(seq.size() * num_states);
+
+        double log_scale = 0;
+        std::vector<double> row(num_states);
+        for (uint64_t t = 0; t < seq.size(); ++t)
+        {
+            auto max_log = std::numeric_limits<double>::lowest();
+            for (uint64_t s = 0; s < num_states; ++s)
+            {
+                row[s] = obs_dist_.log_probability(seq[t], state_id{s});
+                max_log = std::max(max_log, row[s]);
+            }
+            for (uint64_t s = 0; s < num_states; ++s)
+                output[t * num_states + s]
+                    = static_cast<Real>(std::exp(row[s] - max_log));
+            log_scale += max_log;
+        }
+        return log_scale;
+    }
+
+    /**
+     * Runs the scaled forward-backward algorithm on seq, in decreasing
+     * order of time step t:
+     *
+     *  - on_state(t, gamma) is passed the posterior state probabilities
+     *    gamma[s] at t, and
+     *  - on_transitions(t, alpha, weighted) is passed, for t < T - 1, the
+     *    factors of the posterior transition probabilities from t to
+     *    t + 1, which are xi(i, j) = alpha[i] * trans(i, j) * weighted[j].
+     *
+     * The backward pass is fused with these visits, so only the current
+     * row of the backward trellis is kept.
+     *
+     * The output and forward trellises are stored as Real; float halves
+     * their footprint and memory traffic. Every sum is carried out in
+     * double, and the scaling factors and log likelihood are kept in
+     * double regardless.
+     *
+     * @param trans The model's transition_matrix()
+     * @return the log likelihood of seq
+     */
+    template <class Real, class StateFn, class TransitionFn>
+    double forward_backward(const sequence_type& seq,
+                            const std::vector<double>& trans,
+                            StateFn&& on_state,
+                            TransitionFn&& on_transitions) const
+    {
+        std::vector<Real> output;
+        auto log_scale = output_probabilities(seq, output);
+        return log_scale + forward_backward(output, trans, on_state,
+                                            on_transitions);
+    }
+
+    /**
+     * Runs the scaled forward-backward algorithm on precomputed output
+     * probabilities, which may come from any model with the same
+     * observation distribution as this one.
+     *
+     * @param output The output_probabilities() of the sequence
+     * @param trans The model's transition_matrix()
+     * @return the log likelihood of the sequence, less the log scale
+     * returned by output_probabilities()
+     */
+    template <class Real, class StateFn, class TransitionFn>
+    double forward_backward(const std::vector<Real>& output,
+                            const std::vector<double>& trans,
+                            StateFn&& on_state,
+                            TransitionFn&& on_transitions) const
+    {
+        auto num_states = this->num_states();
+        auto length = output.size() / num_states;
+        if (length == 0)
+            return 0;
+
+        double log_likelihood = 0;
+        std::vector<double> row(num_states);
+
+        // forward, normalizing each time step to sum to one
+        std::vector<Real> fwd(length * num_states);
+        std::vector<double> scale(length);
+        for (uint64_t t = 0; t < length; ++t)
+        {
+            if (t == 0)
+            {
+                for (uint64_t j = 0; j < num_states; ++j)
+                    row[j] = init_prob(state_id{j});
+            }
+            else
+            {
+                std::fill(row.begin(), row.end(), 0.0);
+                for (uint64_t i = 0; i < num_states; ++i)
+                {
+                    double prev = fwd[(t - 1) * num_states + i];
+                    const double* trans_row = &trans[i * num_states];
+                    for (uint64_t j = 0; j < num_states; ++j)
+                        row[j] += prev * trans_row[j];
+                }
+            }
+
+            for (uint64_t j = 0; j < num_states; ++j)
+            {
+                row[j] *= output[t * num_states + j];
+                scale[t] += row[j];
+            }
+            for (uint64_t j = 0; j < num_states; ++j)
+                fwd[t * num_states + j] = static_cast<Real>(row[j] / scale[t]);
+            log_likelihood += std::log(scale[t]);
+        }
+
+        // backward, visiting time step t once beta_t is known. Only one
+        // row of the backward trellis is alive at a time, so it is always
+        // kept in double precision
+        std::vector<double> bwd(num_states, 1.0);
+        std::vector<double> alpha(num_states);
+        std::vector<double> weighted(num_states);
+        for (uint64_t t = length; t-- > 0;)
+        {
+            for (uint64_t s = 0; s < num_states; ++s)
+            {
+                alpha[s] = fwd[t * num_states + s];
+                row[s] = alpha[s] * bwd[s];
+            }
+            on_state(t, static_cast<const double*>(row.data()));
+
+            if (t == 0)
+                break;
+
+            // beta_{t-1}(i) = sum_j a_ij b_j(o_t) beta_t(j) / c_t
+            for (uint64_t j = 0; j < num_states; ++j)
+                weighted[j] = output[t * num_states + j] * bwd[j] / scale[t];
+            for (uint64_t i = 0; i < num_states; ++i)
+                alpha[i] = fwd[(t - 1) * num_states + i];
+            on_transitions(t - 1, static_cast<const double*>(alpha.data()),
+                           static_cast<const double*>(weighted.data()));
+
+            for (uint64_t i = 0; i < num_states; ++i)
+            {
+                const double* trans_row = &trans[i * num_states];
+                double sum = 0;
+                for (uint64_t j = 0; j < num_states; ++j)
+                    sum += trans_row[j] * weighted[j];
+                bwd[i] = sum;
+            }
+        }
+
+        return log_likelihood;
+    }
+
+    /**
+     * Advances the filtered state distribution alpha (the normalized
+     * forward probabilities) by one observation, in O(K^2) time plus the
+     * cost of scoring obs under each state.
+     *
+     * @param obs The next observation
+     * @param trans The model's transition_matrix()
+     * @param alpha The num_states filtered probabilities, which are
+     * updated in place; ignored (and overwritten) if first is set
+     * @param first Whether obs is the first observation, in which case
+     * the initial state distribution is used instead of alpha
+     * @return the log probability of obs given the previous observations
+     */
+    double filter(const observation_type& obs,
+                  const std::vector<double>& trans, double* alpha,
+                  bool first) const
+    {
+        auto num_states = this->num_states();
+        std::vector<double> next(num_states);
+        auto max_log = std::numeric_limits<double>::lowest();
+        for (uint64_t s = 0; s < num_states; ++s)
+        {
+            next[s] = obs_dist_.log_probability(obs, state_id{s});
+            max_log = std::max(max_log, next[s]);
+        }
+        for (auto& prob : next)
+            prob = std::exp(prob - max_log);
+
+        std::vector<double> prior(num_states);
+        if (first)
+        {
+            for (uint64_t j = 0; j < num_states; ++j)
+                prior[j] = init_prob(state_id{j});
+        }
+        else
+        {
+            for (uint64_t i = 0; i < num_states; ++i)
+            {
+                const double* trans_row = &trans[i * num_states];
+                for (uint64_t j = 0; j < num_states; ++j)
+                    prior[j] += alpha[i] * trans_row[j];
+            }
+        }
+
+        double scale = 0;
+        for (uint64_t j = 0; j < num_states; ++j)
+        {
+            next[j] *= prior[j];
+            scale += next[j];
+        }
+        for (uint64_t j = 0; j < num_states; ++j)
+            alpha[j] = next[j] / scale;
+
+        return std::log(scale) + max_log;
+    }
+
+    /**
+     * Runs forward-backward on seq and adds the posterior state
+     * probabilities, summed over time, to state_sums, and the posterior
+     * transition probabilities, summed over time, to the row-major
+     * trans_sums. This fuses both accumulations into the backward pass.
+     *
+     * @param trans The model's transition_matrix()
+     * @return the log likelihood of seq
+     */
+    template <class Real>
+    double posterior_sums(const sequence_type& seq,
+                          const std::vector<double>& trans,
+                          std::vector<double>& state_sums,
+                          std::vector<double>& trans_sums) const
+    {
+        std::vector<Real> output;
+        auto log_scale = output_probabilities(seq, output);
+        return log_scale
+               + posterior_sums(output, trans, state_sums, trans_sums);
+    }
+
+    /**
+     * Like posterior_sums() above, but on precomputed output
+     * probabilities (see the corresponding forward_backward()).
+     *
+     * @return the log likelihood of the sequence, less the log scale
+     * returned by output_probabilities()
+     */
+    template <class Real>
+    double posterior_sums(const std::vector<Real>& output,
+                          const std::vector<double>& trans,
+                          std::vector<double>& state_sums,
+                          std::vector<double>& trans_sums) const
+    {
+        auto num_states = this->num_states();
+        auto on_state = [&](uint64_t, const double* gamma) {
+            for (uint64_t s = 0; s < num_states; ++s)
+                state_sums[s] += gamma[s];
+        };
+        auto on_transitions
+            = [&](uint64_t, const double* alpha, const double* weighted) {
+                  for (uint64_t i = 0; i < num_states; ++i)
+                  {
+                      const double* trans_row = &trans[i * num_states];
+                      double* sums = &trans_sums[i * num_states];
+                      for (uint64_t j = 0; j < num_states; ++j)
+                          sums[j] += alpha[i] * trans_row[j] * weighted[j];
+                  }
+              };
+        return forward_backward(output, trans, on_state, on_transitions);
+    }
+
   private:
-    void forward_backward(const sequence_type& seq, expected_counts& counts)
+    /**
+     * Runs EM passes until convergence or the iteration limit, handling
+     * progress reporting, checkpointing and the convergence check. Each
+     * call to pass runs one iteration and returns its log likelihood.
+     */
+    template <class Pass>
+    double fit_passes(uint64_t num_instances, const training_options& options,
+                      training_state& state, Pass&& pass)
     {
-        using fwdbwd = forward_backward_type;
-        // cache b_i(o_t) since this could be computed with an
-        // arbitrarily complex model
-        auto output_probs = fwdbwd::output_probabilities(*this, seq);
+        double old_ll = state.log_likelihood;
+        for (uint64_t iter = state.iteration + 1; iter <= options.max_iters;
+             ++iter)
+        {
+            double log_likelihood = 0;
+
+            auto em_time = common::time([&]() {
+                metrics::stage_timer timer{"em_iteration"};
+                printing::progress progress{"> Iteration "
+                                                + std::to_string(iter) + ": ",
+                                            num_instances};
+                log_likelihood = pass(progress);
+            });
+
+            auto relative_change = (old_ll - log_likelihood) / old_ll;
+            LOG(info) << "Took " << em_time.count() / 1000.0 << "s" << ENDLG;
+
+            state.iteration = iter;
+            state.log_likelihood = log_likelihood;
+
+            if (!options.checkpoint_file.empty()
+                && iter % options.checkpoint_interval == 0)
+            {
+                save_checkpoint(options.checkpoint_file, state);
+            }
+
+            if (iter > 1)
+            {
+                LOG(info) << "Log likelihood: " << log_likelihood << " (+"
+                          << relative_change << " relative change)" << ENDLG;
+            }
+            else
+            {
+                LOG(info) << "Log log_likelihood: " << log_likelihood << ENDLG;
+            }
 
-        // run forward-backward
-        auto fwd = fwdbwd::forward(*this, seq, output_probs);
-        auto bwd = fwdbwd::backward(*this, seq, fwd, output_probs);
+            // online EM is not guaranteed to increase the likelihood, and
+            // near convergence rounding can make a batch step lose a
+            // little, far more so with single-precision trellises
+            assert(options.batch_size > 0
+                   || old_ll - log_likelihood
+                          <= std::abs(old_ll)
+                                 * (options.single_precision ? 1e-4 : 1e-10));
 
-        // compute the probability of being in a given state at a given
-        // time from the trellises
-        auto gamma = fwdbwd::posterior_state_membership(*this, fwd, bwd);
+            if (iter > 1 && relative_change < options.delta)
+            {
+                LOG(info) << "Converged! (" << relative_change << " < "
+                          << options.delta << ")" << ENDLG;
+                return log_likelihood;
+            }
+
+            old_ll = log_likelihood;
+        }
 
-        // increment expected counts
-        fwdbwd::increment_counts(*this, counts, seq, fwd, bwd, gamma,
-                                 output_probs);
+        return old_ll;
+    }
+
+
+    /**
+     * Runs forward-backward on seq and adds its expected counts to
+     * counts. Counts are only accumulated for the parameter groups that
+     * counts has room for.
+     *
+     * @param trans The model's transition_matrix()
+     */
+    void forward_backward(const sequence_type& seq,
+                          const std::vector<double>& trans,
+                          expected_counts& counts, bool single_precision) const
+    {
+        auto num_states = this->num_states();
+        auto on_state = [&](uint64_t t, const double* gamma) {
+            for (uint64_t s = 0; s < num_states; ++s)
+            {
+                if (counts.obs_counts)
+                    counts.obs_counts->increment(seq[t], state_id{s},
+                                                 gamma[s]);
+                if (t == 0 && counts.model_counts.has_initial())
+                    counts.model_counts.increment_initial(state_id{s},
+                                                          gamma[s]);
+            }
+        };
+        auto on_transitions
+            = [&](uint64_t, const double* alpha, const double* weighted) {
+                  if (!counts.model_counts.has_transitions())
+                      return;
+                  for (uint64_t i = 0; i < num_states; ++i)
+                      for (uint64_t j = 0; j < num_states; ++j)
+                          counts.model_counts.increment_transition(
+                              state_id{i}, state_id{j},
+                              alpha[i] * trans[i * num_states + j]
+                                  * weighted[j]);
+              };
+
+        if (single_precision)
+            counts.log_likelihood += forward_backward<float>(
+                seq, trans, on_state, on_transitions);
+        else
+            counts.log_likelihood += forward_backward<double>(
+                seq, trans, on_state, on_transitions);
     }
 
     double expectation_maximization(const training_data_type& instances,
                                     parallel::thread_pool& pool,
-                                    printing::progress& progress)
+                                    printing::progress& progress,
+                                    const training_options& options)
     {
-        uint64_t seq_id = 0;
         // compute expected counts across all instances in parallel
+        auto counts = expectation(instances, pool, progress, options.frozen,
+                                  options.single_precision);
+        maximization(counts);
+
+        return counts.log_likelihood;
+    }
+
+    /**
+     * Runs one SQUAREM (squared iterative method, Varadhan and Roland,
+     * 2008) cycle: two EM steps theta0 -> theta1 -> theta2, followed by
+     * the extrapolation
+     *
+     *     theta' = theta0 - 2 alpha r + alpha^2 v,
+     *
+     * where r = theta1 - theta0, v = theta2 - 2 theta1 + theta0, and
+     * alpha = -|r| / |v| (clamped to at most -1, which gives theta2).
+     * Negative extrapolated parameters are clamped to zero. If the
+     * likelihood at theta' is no better than at theta1 the model falls
+     * back to theta2; otherwise it takes an EM step from theta'.
+     *
+     * theta' is mapped back to a model by the M-step, which treats its
+     * probabilities as counts and so applies the Dirichlet prior to them
+     * a second time. With the small pseudo-counts used for training this
+     * only nudges theta' slightly toward the prior mean, and the
+     * likelihood check is made after the nudge, so it cannot make a cycle
+     * worse than plain EM.
+     *
+     * @return the best log likelihood computed during the cycle, which
+     * never decreases from one cycle to the next
+     */
+    double accelerated_expectation_maximization(
+        const training_data_type& instances, parallel::thread_pool& pool,
+        printing::progress& progress, const training_options& options)
+    {
+        auto theta0 = parameters(options.frozen);
+        auto counts = expectation(instances, pool, progress, options.frozen,
+                                  options.single_precision);
+        maximization(counts);
+
+        auto theta1 = parameters(options.frozen);
+        counts = expectation(instances, pool, progress, options.frozen,
+                             options.single_precision);
+        auto theta1_ll = counts.log_likelihood;
+        maximization(counts);
+
+        auto theta2 = parameters(options.frozen);
+        auto theta2_obs_dist = obs_dist_;
+        auto theta2_model = model_;
+
+        auto r = theta1;
+        r.add(theta0, -1.0);
+        auto v = theta2;
+        v.add(theta1, -2.0);
+        v.add(theta0, 1.0);
+
+        auto v_norm = v.sum_of_squares();
+        if (v_norm == 0)
+            return theta1_ll;
+
+        auto alpha = std::min(-std::sqrt(r.sum_of_squares() / v_norm), -1.0);
+        if (alpha == -1.0)
+            return theta1_ll;
+
+        auto extrapolated = theta0;
+        extrapolated.add(r, -2 * alpha);
+        extrapolated.add(v, alpha * alpha);
+        extrapolated.clamp(0.0);
+        // smooths theta' again; see above
+        maximization(extrapolated);
+
+        counts = expectation(instances, pool, progress, options.frozen,
+                             options.single_precision);
+        if (!(counts.log_likelihood > theta1_ll))
+        {
+            LOG(info) << "Rejected extrapolation (step length " << -alpha
+                      << ")" << ENDLG;
+            obs_dist_ = std::move(theta2_obs_dist);
+            model_ = std::move(theta2_model);
+            return theta1_ll;
+        }
+
+        LOG(info) << "Accepted extrapolation (step length " << -alpha << ")"
+                  << ENDLG;
+        maximization(counts);
+        return counts.log_likelihood;
+    }
+
+    /**
+     * The current parameters, as expected counts that the M-step maps back
+     * to (up to smoothing) the same parameters.
+     */
+    expected_counts parameters(const parameter_groups& frozen) const
+    {
+        expected_counts params{*this, frozen};
+        if (params.obs_counts)
+            params.obs_counts->assign(obs_dist_);
+        params.model_counts.assign(model_);
+        return params;
+    }
+
+    /**
+     * Runs one iteration of batch EM over blocks of instances, running
+     * forward-backward on each block in parallel and accumulating the
+     * expected counts across blocks.
+     */
+    template <class BlockSource>
+    double streaming_expectation_maximization(BlockSource& blocks,
+                                              parallel::thread_pool& pool,
+                                              printing::progress& progress,
+                                              const training_options& options)
+    {
+        blocks.rewind();
+
+        auto trans = transition_matrix();
+        expected_counts counts{*this, options.frozen};
+        std::vector<sequence_type> block;
+        uint64_t seq_id = 0;
         std::mutex progress_mutex;
-        auto counts = parallel::reduction(
-            instances.begin(), instances.end(), pool,
-            [&]() { return expected_counts{*this}; },
-            [&](expected_counts& counts, const sequence_type& seq) {
-                {
-                    std::lock_guard<std::mutex> lock{progress_mutex};
-                    progress(seq_id++);
-                }
-                forward_backward(seq, counts);
-            },
-            [&](expected_counts& result, const expected_counts& temp) {
-                result += temp;
-            });
+        while (blocks.next(block))
+        {
+            metrics::stage_timer timer{"em_expectation"};
+            metrics::get_counter("em_instances") += block.size();
+            counts += parallel::reduction(
+                block.begin(), block.end(), pool,
+                [&]() { return expected_counts{*this, options.frozen}; },
+                [&](expected_counts& counts, const sequence_type& seq) {
+                    {
+                        std::lock_guard<std::mutex> lock{progress_mutex};
+                        progress(seq_id++);
+                    }
+                    forward_backward(seq, trans, counts,
+                                     options.single_precision);
+                },
+                [&](expected_counts& result, const expected_counts& temp) {
+                    result += temp;
+                });
+        }
 
-        // normalize and replace old parameters
-#if 0
-        obs_dist_ = ObsDist{std::move(counts.obs_counts)};
-#endif
-        model_ = markov_model{std::move(counts.model_counts)};
+        maximization(counts);
 
         return counts.log_likelihood;
     }
 
+    /**
+     * Runs one pass of online (stepwise) EM over the instances in a random
+     * order, re-estimating the parameters after every mini-batch. Each
+     * mini-batch is processed in parallel on the pool.
+     *
+     * @return the sum of the mini-batch log likelihoods, each computed
+     * under the parameters current at the time
+     */
+    double online_expectation_maximization(const training_data_type& instances,
+                                           parallel::thread_pool& pool,
+                                           printing::progress& progress,
+                                           const training_options& options,
+                                           training_state& state)
+    {
+        std::vector<uint64_t> order(instances.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), state.rng);
+
+        double log_likelihood = 0;
+        uint64_t seq_id = 0;
+        std::mutex progress_mutex;
+        for (auto begin = order.begin(); begin != order.end();)
+        {
+            auto size = std::min<uint64_t>(options.batch_size,
+                                           std::distance(begin, order.end()));
+            auto end = begin + static_cast<std::ptrdiff_t>(size);
+            auto trans = transition_matrix();
+
+            metrics::stage_timer timer{"em_expectation"};
+            metrics::get_counter("em_instances") += size;
+            auto counts = parallel::reduction(
+                begin, end, pool,
+                [&]() { return expected_counts{*this, options.frozen}; },
+                [&](expected_counts& counts, uint64_t idx) {
+                    {
+                        std::lock_guard<std::mutex> lock{progress_mutex};
+                        progress(seq_id++);
+                    }
+                    forward_backward(instances[idx], trans, counts,
+                                     options.single_precision);
+                },
+                [&](expected_counts& result, const expected_counts& temp) {
+                    result += temp;
+                });
+            timer.stop();
+            log_likelihood += counts.log_likelihood;
+
+            // scale the mini-batch up to the size of the full data, so the
+            // smoothing prior has the same relative weight as in batch EM
+            counts *= static_cast<double>(instances.size()) / size;
+
+            if (!state.running_counts)
+            {
+                state.running_counts = std::move(counts);
+            }
+            else
+            {
+                auto rate = std::pow(state.num_updates + options.step_offset,
+                                     -options.step_exponent);
+                *state.running_counts *= 1.0 - rate;
+                counts *= rate;
+                *state.running_counts += counts;
+            }
+            ++state.num_updates;
+
+            maximization(*state.running_counts);
+            begin = end;
+        }
+
+        return log_likelihood;
+    }
+
+    /**
+     * Normalizes the expected counts and replaces the old parameters.
+     * Parameter groups whose counts were left out are kept as they are.
+     */
+    void maximization(const expected_counts& counts)
+    {
+        metrics::stage_timer timer{"em_maximization"};
+        if (counts.obs_counts)
+            obs_dist_ = counts.obs_counts->estimate(obs_dist_);
+        if (counts.model_counts.has_initial()
+            || counts.model_counts.has_transitions())
+        {
+            model_ = counts.model_counts.estimate(model_);
+        }
+    }
+
     ObsDist obs_dist_;
     markov_model model_;
 };
@@ -0,0 +1,326 @@
+/**
+ * @file socket_stream.h
+ * Minimal blocking socket I/O for exchanging model parameters and
+ * expected counts between processes. Addresses are either "host:port"
+ * for TCP or "unix:/path/to/socket" for Unix domain sockets.
+ */
+
+#ifndef CLICKSTREAM_SOCKET_STREAM_H_
+#define CLICKSTREAM_SOCKET_STREAM_H_
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace meta
+{
+namespace net
+{
+
+class socket_exception : public std::runtime_error
+{
+  public:
+    using std::runtime_error::runtime_error;
+};
+
+namespace detail
+{
+inline socket_exception socket_error(const std::string& what)
+{
+    return socket_exception{what + ": " + std::strerror(errno)};
+}
+
+/**
+ * A parsed socket address.
+ */
+struct address
+{
+    bool is_unix;
+    std::string host; // or path, for Unix sockets
+    std::string port;
+};
+
+inline address parse_address(const std::string& str)
+{
+    const std::string unix_prefix = "unix:";
+    if (str.compare(0, unix_prefix.size(), unix_prefix) == 0)
+        return {true, str.substr(unix_prefix.size()), ""};
+
+    auto colon = str.rfind(':');
+    if (colon == std::string::npos)
+        throw socket_exception{"invalid address (expected host:port or "
+                               "unix:path): "
+                               + str};
+    return {false, str.substr(0, colon), str.substr(colon + 1)};
+}
+
+inline sockaddr_un unix_address(const std::string& path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw socket_exception{"socket path too long: " + path};
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+/**
+ * Calls fn on each address that host:port resolves to until it returns
+ * a valid file descriptor.
+ */
+template <class Function>
+int for_each_tcp_address(const address& addr, bool passive, Function&& fn)
+{
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+        hints.ai_flags = AI_PASSIVE;
+
+    addrinfo* result;
+    auto host = addr.host.empty() ? nullptr : addr.host.c_str();
+    if (auto err = ::getaddrinfo(host, addr.port.c_str(), &hints, &result))
+        throw socket_exception{"failed to resolve " + addr.host + ":"
+                               + addr.port + ": " + ::gai_strerror(err)};
+
+    int fd = -1;
+    for (auto ai = result; ai && fd < 0; ai = ai->ai_next)
+        fd = fn(ai);
+    ::freeaddrinfo(result);
+    return fd;
+}
+}
+
+/**
+ * A stream buffer that reads from and writes to a connected socket.
+ * Takes ownership of the file descriptor.
+ */
+class socket_buf : public std::streambuf
+{
+  public:
+    explicit socket_buf(int fd) : fd_{fd}
+    {
+        setg(in_.data(), in_.data(), in_.data());
+        setp(out_.data(), out_.data() + out_.size());
+    }
+
+    socket_buf(const socket_buf&) = delete;
+    socket_buf& operator=(const socket_buf&) = delete;
+
+    ~socket_buf()
+    {
+        flush_output();
+        ::close(fd_);
+    }
+
+  protected:
+    int_type underflow() override
+    {
+        ssize_t bytes;
+        do
+        {
+            bytes = ::recv(fd_, in_.data(), in_.size(), 0);
+        } while (bytes < 0 && errno == EINTR);
+
+        if (bytes <= 0)
+            return traits_type::eof();
+
+        setg(in_.data(), in_.data(), in_.data() + bytes);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type ch) override
+    {
+        if (!flush_output())
+            return traits_type::eof();
+
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override
+    {
+        return flush_output() ? 0 : -1;
+    }
+
+  private:
+    bool flush_output()
+    {
+        auto data = pbase();
+        while (data < pptr())
+        {
+            // MSG_NOSIGNAL: a dead peer is an error, not a SIGPIPE
+            auto bytes = ::send(fd_, data, pptr() - data, MSG_NOSIGNAL);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes <= 0)
+                return false;
+            data += bytes;
+        }
+        setp(out_.data(), out_.data() + out_.size());
+        return true;
+    }
+
+    int fd_;
+    std::array<char, 1 << 16> in_;
+    std::array<char, 1 << 16> out_;
+};
+
+/**
+ * An iostream over a connected socket.
+ */
+class socket_stream : public std::iostream
+{
+  public:
+    explicit socket_stream(int fd) : std::iostream{nullptr}, buf_{fd}
+    {
+        rdbuf(&buf_);
+    }
+
+  private:
+    socket_buf buf_;
+};
+
+/**
+ * Connects to a listening socket at the given address.
+ * @return the connected file descriptor
+ */
+inline int connect_socket(const std::string& address)
+{
+    auto addr = detail::parse_address(address);
+    if (addr.is_unix)
+    {
+        auto sun = detail::unix_address(addr.host);
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            throw detail::socket_error("socket");
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) < 0)
+        {
+            ::close(fd);
+            throw detail::socket_error("failed to connect to " + address);
+        }
+        return fd;
+    }
+
+    int fd = detail::for_each_tcp_address(addr, false, [](addrinfo* ai) {
+        int fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            return -1;
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        // we exchange a few large messages per iteration, so don't let
+        // Nagle's algorithm hold back the tail of each one
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    });
+    if (fd < 0)
+        throw detail::socket_error("failed to connect to " + address);
+    return fd;
+}
+
+/**
+ * A socket listening for connections at an address.
+ */
+class socket_listener
+{
+  public:
+    explicit socket_listener(const std::string& address)
+    {
+        auto addr = detail::parse_address(address);
+        if (addr.is_unix)
+        {
+            path_ = addr.host;
+            auto sun = detail::unix_address(path_);
+            ::unlink(path_.c_str());
+            fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd_ < 0)
+                throw detail::socket_error("socket");
+            if (::bind(fd_, reinterpret_cast<sockaddr*>(&sun), sizeof(sun))
+                < 0)
+            {
+                ::close(fd_);
+                throw detail::socket_error("failed to bind " + address);
+            }
+        }
+        else
+        {
+            fd_ = detail::for_each_tcp_address(addr, true, [](addrinfo* ai) {
+                int fd
+                    = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (fd < 0)
+                    return -1;
+                int one = 1;
+                ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                if (::bind(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+                {
+                    ::close(fd);
+                    return -1;
+                }
+                return fd;
+            });
+            if (fd_ < 0)
+                throw detail::socket_error("failed to bind " + address);
+        }
+
+        if (::listen(fd_, SOMAXCONN) < 0)
+            throw detail::socket_error("failed to listen on " + address);
+    }
+
+    socket_listener(const socket_listener&) = delete;
+    socket_listener& operator=(const socket_listener&) = delete;
+
+    ~socket_listener()
+    {
+        ::close(fd_);
+        if (!path_.empty())
+            ::unlink(path_.c_str());
+    }
+
+    /**
+     * Blocks until a connection arrives.
+     * @return the connected file descriptor
+     */
+    int accept()
+    {
+        int fd;
+        do
+        {
+            fd = ::accept(fd_, nullptr, nullptr);
+        } while (fd < 0 && errno == EINTR);
+
+        if (fd < 0)
+            throw detail::socket_error("accept");
+
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+
+  private:
+    int fd_;
+    std::string path_;
+};
+}
+}
+#endif
@@ -0,0 +1,155 @@
+"""
+Runs the pipeline end to end on synthetic clickstreams of several sizes,
+timing each stage and recording its peak resident memory.
+
+Each scale generates a dump with generate-clickstream, then runs sort,
+check-sorted, extract-sequences, plain-mm, a fixed number of EM
+iterations of clickstream-hmm, and decode on the result. The report is
+written as JSON.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def run(args, stdin_path, stdout_path, cwd):
+    """
+    Runs a command with its standard input and output redirected to files,
+    returning its wall time and the peak resident set size (in KB) taken
+    from wait4. Linux counts the memory of this (forked) process before the
+    exec, so the peak is never below about 10 MB.
+    """
+    with open(stdin_path, 'rb') as stdin, open(stdout_path, 'wb') as stdout:
+        start = time.perf_counter()
+        proc = subprocess.Popen(args, stdin=stdin, stdout=stdout,
+                                stderr=subprocess.DEVNULL, cwd=cwd)
+        _, status, usage = os.wait4(proc.pid, 0)
+        seconds = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+
+    if proc.returncode != 0:
+        raise RuntimeError('{} exited with status {}'.format(
+            ' '.join(args), proc.returncode))
+
+    return {'seconds': seconds,
+            'user_seconds': usage.ru_utime,
+            'system_seconds': usage.ru_stime,
+            'peak_rss_kb': usage.ru_maxrss}
+
+
+def count_lines(path):
+    with open(path, 'rb') as f:
+        return sum(1 for _ in f)
+
+
+def stage(name, args, stdin_path, stdout_path, cwd, units=None):
+    """
+    Runs one stage and reports its throughput over its input.
+    """
+    result = run(args, stdin_path, stdout_path, cwd)
+    size = os.path.getsize(stdin_path)
+    lines = count_lines(stdin_path)
+    result.update({'stage': name,
+                   'input_bytes': size,
+                   'input_lines': lines,
+                   'mb_per_second': size / 1e6 / result['seconds'],
+                   'lines_per_second': lines / result['seconds']})
+    if units is not None:
+        result['seconds_per_' + units[0]] = result['seconds'] / units[1]
+    print('{:>20}: {:8.2f}s {:10.0f} lines/s {:8d} KB peak'.format(
+        name, result['seconds'], result['lines_per_second'],
+        result['peak_rss_kb']), file=sys.stderr)
+    return result
+
+
+def benchmark_scale(build_dir, work_dir, users, events, args):
+    def binary(name):
+        return os.path.join(build_dir, name)
+
+    def path(name):
+        return os.path.join(work_dir, name)
+
+    print('Scale: {} users, {} events'.format(users, events), file=sys.stderr)
+
+    gen_args = [binary('generate-clickstream'), '--users', str(users),
+                '--events', str(events), '--skew', str(args.skew),
+                '--seed', str(args.seed)]
+    generate = run(gen_args, os.devnull, path('raw.json'), work_dir)
+    generate['stage'] = 'generate-clickstream'
+
+    results = [generate]
+    results.append(stage('sort', [binary('sort'), str(args.sort_ram)],
+                         path('raw.json'), path('sorted.json'), work_dir))
+    results.append(stage('check-sorted', [binary('check-sorted')],
+                         path('sorted.json'), os.devnull, work_dir))
+    results.append(stage('extract-sequences', [binary('extract-sequences')],
+                         path('sorted.json'), path('sequences.json'),
+                         work_dir))
+    results.append(stage('plain-mm', [binary('plain-mm')],
+                         path('sequences.json'), path('plain-mm.json'),
+                         work_dir))
+    results.append(stage('clickstream-hmm',
+                         [binary('clickstream-hmm'), str(args.states),
+                          '--max-iters', str(args.em_iters)],
+                         path('sequences.json'), os.devnull, work_dir,
+                         units=('iteration', args.em_iters)))
+    results.append(stage('decode',
+                         [binary('decode'), path('hmm-model.gz')],
+                         path('sequences.json'), path('decoded.json'),
+                         work_dir))
+
+    return {'users': users, 'events': events, 'stages': results}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--build-dir', default='build',
+                        help='directory containing the built executables')
+    parser.add_argument('--work-dir',
+                        help='directory for intermediate files (default: a '
+                             'temporary directory that is removed)')
+    parser.add_argument('--scales', default='1000:100000,10000:1000000',
+                        help='comma-separated users:events pairs')
+    parser.add_argument('--states', type=int, default=5,
+                        help='number of hidden states for clickstream-hmm')
+    parser.add_argument('--em-iters', type=int, default=3,
+                        help='number of EM iterations to time')
+    parser.add_argument('--skew', type=int, default=5000,
+                        help='timestamp jitter in milliseconds')
+    parser.add_argument('--sort-ram', type=int, default=1,
+                        help='GB of RAM for sort')
+    parser.add_argument('--seed', type=int, default=47)
+    parser.add_argument('--output', help='file for the JSON report '
+                                         '(default: stdout)')
+    args = parser.parse_args()
+
+    build_dir = os.path.abspath(args.build_dir)
+    work_dir = args.work_dir or tempfile.mkdtemp(prefix='clickstream-bench-')
+    os.makedirs(work_dir, exist_ok=True)
+
+    report = {'cpus': os.cpu_count(), 'scales': []}
+    try:
+        for scale in args.scales.split(','):
+            users, events = (int(x) for x in scale.split(':'))
+            report['scales'].append(
+                benchmark_scale(build_dir, work_dir, users, events, args))
+    finally:
+        if not args.work_dir:
+            shutil.rmtree(work_dir)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2)
+    else:
+        json.dump(report, sys.stdout, indent=2)
+        print()
+
+
+if __name__ == '__main__':
+    main()
@@ -10,7 +10,13 @@ fi
 SCRIPTDIR=/srv/data/mooc/clickstream-hmm/scripts
 POST_TIMES_TO_JSON=$SCRIPTDIR/post_times_to_json.sh
 QUIZ_TIMES_TO_JSON=$SCRIPTDIR/quiz_times_to_json.sh
-SORTSH=$SCRIPTDIR/sort.sh
+MERGE=/srv/data/mooc/clickstream-hmm/build/merge-sorted
+OUTPUT_FILENAME=clickstream_with_post_and_quiz.json.sorted.gz
+
+if [ -e $OUTPUT_FILENAME ]; then
+  echo $OUTPUT_FILENAME already exists!
+  exit 1
+fi
 
 echo "Extracting post times..."
 $POST_TIMES_TO_JSON $1 > post-times.json
@@ -18,9 +24,6 @@ echo "Extracting quiz times..."
 $QUIZ_TIMES_TO_JSON $1 > quiz-times.json
 echo "Compressing quiz and post times..."
 pigz post-times.json quiz-times.json
-echo "Incorporating quiz and post times into clickstream..."
-pv $2 | zcat - post-times.json.gz quiz-times.json.gz | pigz > clickstream_with_post_and_quiz.json.gz
-echo "Sorting..."
-$SORTSH clickstream_with_post_and_quiz.json.gz
-rm clickstream_with_post_and_quiz.json.gz
+echo "Merging quiz and post times into the sorted clickstream..."
+$MERGE --dedup $2 post-times.json.gz quiz-times.json.gz | pigz > $OUTPUT_FILENAME
 echo "Done!"
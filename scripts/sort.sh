@@ -18,4 +18,4 @@ if [ -e $OUTPUT_FILENAME ]; then
 fi
 
 echo Sorting $FILENAME into $OUTPUT_FILENAME...
-pv $FILENAME | zcat | $SORTBIN 4 | pigz > $OUTPUT_FILENAME
+pv $FILENAME | zcat | $SORTBIN 4 --dedup | pigz > $OUTPUT_FILENAME
@@ -7,16 +7,23 @@
 #include <string>
 
 #include "json.hpp"
+#include "metrics.h"
 #include "meta/util/progress.h"
 
 using namespace nlohmann;
 
 int main()
 {
+    meta::metrics::session session{"check-sorted"};
+    auto& lines = meta::metrics::get_counter("lines");
+    auto& bytes = meta::metrics::get_counter("bytes");
+
     uint64_t timestamp = 0;
     std::string line;
     for (uint64_t lineno = 0; std::getline(std::cin, line); ++lineno)
     {
+        ++lines;
+        bytes += line.size() + 1;
         auto obj = json::parse(line);
         auto time = obj["timestamp"].get<uint64_t>();
         if (time < timestamp)
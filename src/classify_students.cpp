@@ -2,79 +2,317 @@
  * @file classify_students.cpp
  * Given two files produced by the decode application (one for "positive",
  * one for "negative"), run a simple classification experiment on them.
+ * Either file may be a JSON array or line-delimited JSON.
+ *
+ * Each student's state probabilities and transition probabilities are
+ * flattened into one row of a dense feature matrix. The mutual
+ * information between the latent states and the label is computed from
+ * the matrix, and an SGD classifier is evaluated with k-fold
+ * cross-validation, with the folds trained in parallel.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <numeric>
+#include <random>
+
 #include "json.hpp"
+#include "json_records.h"
+#include "metrics.h"
 
+#include "meta/classify/binary_dataset.h"
+#include "meta/classify/binary_dataset_view.h"
 #include "meta/classify/classifier/sgd.h"
+#include "meta/learn/loss/hinge.h"
 #include "meta/logging/logger.h"
+#include "meta/parallel/thread_pool.h"
+#include "meta/util/string_view.h"
 
 using namespace meta;
 using namespace nlohmann;
 
-int main(int argc, char** argv)
+/**
+ * A dense, row-major matrix of features with one row per student: the K
+ * state probabilities followed by the K x K transition probabilities.
+ */
+struct feature_matrix
 {
-    logging::set_cerr_logging();
+    void add_row(const json& student, bool label)
+    {
+        const auto& state_probs = student["state_probs"];
+        const auto& transitions = student["transitions"];
+        if (num_states == 0)
+            num_states = state_probs.size();
+        if (state_probs.size() != num_states)
+            throw std::runtime_error{"students decoded with differing numbers "
+                                     "of states"};
+
+        for (const auto& prob : state_probs)
+            values.push_back(value(prob));
+        for (const auto& row : transitions)
+            for (const auto& prob : row)
+                values.push_back(value(prob));
+        labels.push_back(label);
+    }
 
-    if (argc != 3)
+    // students with no transitions out of a state have no posterior
+    // transition probabilities from it
+    static double value(const json& prob)
     {
-        std::cerr << "Usage: " << argv[0] << " positive.json negative.json"
-                  << std::endl;
+        return prob.is_null() ? 0.0 : prob.get<double>();
     }
 
-    json pos_json;
-    json neg_json;
+    uint64_t num_features() const
     {
-        std::ifstream pos_file{argv[1]};
-        pos_file >> pos_json;
+        return num_states + num_states * num_states;
+    }
 
-        std::ifstream neg_file{argv[2]};
-        neg_file >> neg_json;
+    uint64_t num_rows() const
+    {
+        return labels.size();
+    }
+
+    const double* row(uint64_t i) const
+    {
+        return &values[i * num_features()];
     }
 
-    uint64_t total = pos_json.size() + neg_json.size();
+    uint64_t num_states = 0;
+    std::vector<double> values;
+    std::vector<bool> labels;
+};
 
-    auto p_y1 = static_cast<double>(pos_json.size()) / total;
-    auto p_y0 = static_cast<double>(neg_json.size()) / total;
+/**
+ * Prints the mutual information between the (soft) latent state and the
+ * label. The per-state probability mass is summed over each class in one
+ * pass over the matrix.
+ */
+void mutual_information(const feature_matrix& features)
+{
+    auto total = features.num_rows();
+    auto num_states = features.num_states;
+
+    std::vector<double> p_x_y1(num_states);
+    std::vector<double> p_x_y0(num_states);
+    uint64_t positives = 0;
+    for (uint64_t i = 0; i < total; ++i)
+    {
+        const double* row = features.row(i);
+        auto& sums = features.labels[i] ? p_x_y1 : p_x_y0;
+        for (uint64_t s = 0; s < num_states; ++s)
+            sums[s] += row[s];
+        positives += features.labels[i];
+    }
+
+    auto p_y1 = static_cast<double>(positives) / total;
+    auto p_y0 = static_cast<double>(total - positives) / total;
 
     std::cout << "p(y = 1): " << p_y1 << "\n";
     std::cout << "p(y = 0): " << p_y0 << "\n";
 
     auto mi = 0.0;
-    for (uint64_t i = 0; i < pos_json[0]["state_probs"].size(); ++i)
+    for (uint64_t i = 0; i < num_states; ++i)
     {
-        auto p_xi = 0.0;
-        auto p_xi_y1 = 0.0;
-        auto p_xi_y0 = 0.0;
-
-        for (const auto& l : pos_json)
-        {
-            auto prob = l["state_probs"][i].get<double>();
-            p_xi += prob;
-            p_xi_y1 += prob;
-        }
-
-        for (const auto& l : neg_json)
-        {
-            auto prob = l["state_probs"][i].get<double>();
-            p_xi += prob;
-            p_xi_y0 += prob;
-        }
-
-        p_xi /= total;
-        p_xi_y1 /= total;
-        p_xi_y0 /= total;
+        auto p_xi_y1 = p_x_y1[i] / total;
+        auto p_xi_y0 = p_x_y0[i] / total;
+        auto p_xi = p_xi_y1 + p_xi_y0;
 
         std::cout << "p(x = " << i << "): " << p_xi << "\n";
         std::cout << "p(x = " << i << ", y = 1): " << p_xi_y1 << "\n";
         std::cout << "p(x = " << i << ", y = 0): " << p_xi_y0 << "\n";
 
-
         mi += p_xi_y1 * std::log(p_xi_y1 / (p_xi * p_y1));
         mi += p_xi_y0 * std::log(p_xi_y0 / (p_xi * p_y0));
     }
 
     std::cout << "MI is " << mi << std::endl;
+}
+
+/**
+ * The confusion counts of one fold.
+ */
+struct fold_result
+{
+    fold_result& operator+=(const fold_result& other)
+    {
+        true_pos += other.true_pos;
+        false_pos += other.false_pos;
+        true_neg += other.true_neg;
+        false_neg += other.false_neg;
+        return *this;
+    }
+
+    void print(std::ostream& os) const
+    {
+        auto total = true_pos + false_pos + true_neg + false_neg;
+        auto precision = static_cast<double>(true_pos)
+                         / std::max<uint64_t>(true_pos + false_pos, 1);
+        auto recall = static_cast<double>(true_pos)
+                      / std::max<uint64_t>(true_pos + false_neg, 1);
+        auto f1 = precision + recall > 0
+                      ? 2 * precision * recall / (precision + recall)
+                      : 0.0;
+        os << "accuracy " << static_cast<double>(true_pos + true_neg) / total
+           << ", precision " << precision << ", recall " << recall
+           << ", F1 " << f1 << "\n";
+    }
+
+    uint64_t true_pos = 0;
+    uint64_t false_pos = 0;
+    uint64_t true_neg = 0;
+    uint64_t false_neg = 0;
+};
+
+/**
+ * Trains an SGD classifier on every fold but one and evaluates it on the
+ * remaining fold, for each of the k folds in parallel.
+ */
+std::vector<fold_result> cross_validate(const feature_matrix& features,
+                                        uint64_t num_folds)
+{
+    std::vector<uint64_t> rows(features.num_rows());
+    std::iota(rows.begin(), rows.end(), 0);
+
+    classify::binary_dataset dataset{
+        rows.begin(), rows.end(), features.num_features(),
+        [&](uint64_t i) {
+            learn::feature_vector fv;
+            const double* row = features.row(i);
+            for (uint64_t f = 0; f < features.num_features(); ++f)
+            {
+                if (row[f] != 0)
+                    fv.emplace_back(learn::feature_id{f}, row[f]);
+            }
+            return fv;
+        },
+        [&](uint64_t i) { return static_cast<bool>(features.labels[i]); }};
+
+    classify::binary_dataset_view docs{dataset, std::mt19937{47}};
+    docs.shuffle();
+
+    // fold k is [k * n / num_folds, (k + 1) * n / num_folds), so the
+    // remainder is spread over the folds and every student is tested once
+    auto n = docs.size();
+    parallel::thread_pool pool;
+    metrics::track_threads(pool);
+    std::vector<std::future<fold_result>> folds;
+    for (uint64_t k = 0; k < num_folds; ++k)
+    {
+        auto fold_begin = k * n / num_folds;
+        auto fold_end = (k + 1) * n / num_folds;
+        auto fold_size = fold_end - fold_begin;
+
+        // rotating the shuffled view puts the kth fold at the end
+        auto view = docs;
+        view.rotate(fold_end % n);
+        folds.push_back(pool.submit_task([view, fold_size]() {
+            auto split = view.begin() + static_cast<std::ptrdiff_t>(
+                                            view.size() - fold_size);
+            classify::binary_dataset_view train{view, view.begin(), split};
+            classify::binary_dataset_view test{view, split, view.end()};
+
+            classify::sgd clf{train,
+                              std::make_unique<learn::loss::hinge>()};
+
+            fold_result result;
+            for (const auto& instance : test)
+            {
+                auto label = test.label(instance);
+                auto predicted = clf.classify(instance.weights);
+                if (predicted)
+                    ++(label ? result.true_pos : result.false_pos);
+                else
+                    ++(label ? result.false_neg : result.true_neg);
+            }
+            return result;
+        }));
+    }
+
+    std::vector<fold_result> results;
+    for (auto& fold : folds)
+        results.push_back(fold.get());
+    return results;
+}
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"classify-students"};
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " positive.json negative.json [--folds k]"
+                     " [--model file|index]"
+                  << std::endl;
+        return 1;
+    };
+
+    if (argc < 3)
+        return usage();
+
+    uint64_t num_folds = 5;
+    // which model's posteriors to use when decode was given several
+    std::string model;
+    for (int i = 3; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (i + 1 == argc)
+            return usage();
+
+        if (flag == "--folds")
+            num_folds = std::stoull(argv[++i]);
+        else if (flag == "--model")
+            model = argv[++i];
+        else
+            return usage();
+    }
+
+    feature_matrix features;
+    {
+        metrics::stage_timer timer{"read"};
+        std::ifstream pos_file{argv[1]};
+        for_each_json_record(pos_file, [&](const json& student) {
+            features.add_row(select_model(student, model), true);
+        });
+
+        std::ifstream neg_file{argv[2]};
+        for_each_json_record(neg_file, [&](const json& student) {
+            features.add_row(select_model(student, model), false);
+        });
+    }
+
+    if (num_folds < 2 || num_folds > features.num_rows())
+    {
+        std::cerr << "The number of folds must be between 2 and the number "
+                     "of students"
+                  << std::endl;
+        return 1;
+    }
+
+    metrics::get_counter("students") += features.num_rows();
+    {
+        metrics::stage_timer timer{"mutual_information"};
+        mutual_information(features);
+    }
+
+    LOG(info) << "Running " << num_folds << "-fold cross-validation on "
+              << features.num_rows() << " students with "
+              << features.num_features() << " features..." << ENDLG;
+
+    fold_result overall;
+    metrics::stage_timer cv_timer{"cross_validate"};
+    auto results = cross_validate(features, num_folds);
+    cv_timer.stop();
+    for (uint64_t k = 0; k < results.size(); ++k)
+    {
+        std::cout << "Fold " << k + 1 << ": ";
+        results[k].print(std::cout);
+        overall += results[k];
+    }
+    std::cout << "Overall: ";
+    overall.print(std::cout);
 
     return 0;
 }
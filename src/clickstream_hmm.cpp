@@ -2,19 +2,36 @@
  * @file clickstream_hmm.cpp
  * Fits a hidden markov model with sequence observations to the extracted
  * sequences for students from a Coursera clickstream dump.
+ *
+ * Since EM is sensitive to its initialization, several randomly
+ * initialized models can be trained at once over the same training data,
+ * keeping only the one with the highest log likelihood. A range of
+ * numbers of hidden states can also be swept in one run for model
+ * selection.
  */
 
+#include <algorithm>
 #include <array>
 #include <exception>
+#include <limits>
+#include <thread>
 
+#include "block_reader.h"
+#include "distributed_em.h"
 #include "json.hpp"
+#include "metrics.h"
+#include "model_builder.h"
+#include "retrofit_hmm.h"
 
+#include "meta/io/filesystem.h"
 #include "meta/io/gzstream.h"
+#include "meta/io/packed.h"
 #include "meta/logging/logger.h"
-#include "meta/sequence/hmm/hmm.h"
 #include "meta/sequence/hmm/sequence_observations.h"
 #include "meta/stats/running_stats.h"
 #include "meta/util/identifiers.h"
+#include "meta/util/optional.h"
+#include "meta/util/time.h"
 
 using namespace nlohmann;
 using namespace meta;
@@ -37,78 +54,676 @@ util::string_view action_name(sequence::state_id aid)
     return actions[aid];
 }
 
-int main(int argc, char** argv)
-{
-    logging::set_cerr_logging();
+using hmm_type
+    = sequence::hmm::hidden_markov_model<sequence::hmm::sequence_observations>;
+using sequence_type = hmm_type::sequence_type;
+using training_data_type = hmm_type::training_data_type;
 
-    if (argc != 2)
-    {
-        std::cerr << "Usage: " << argv[0] << " num_states" << std::endl;
-        return 1;
-    }
-
-    uint64_t num_states = std::stoull(argv[1]);
+const uint64_t num_actions = 10;
+const double smoothing_constant = 1e-6;
 
+/**
+ * Constructs a randomly initialized model.
+ */
+hmm_type make_model(uint64_t num_states, std::mt19937& rng)
+{
     using namespace sequence;
-    using action_sequence_type = std::vector<state_id>;
-    using sequence_type = std::vector<action_sequence_type>;
-    using training_data_type = std::vector<sequence_type>;
+    using namespace hmm;
 
-    std::vector<std::string> usernames;
-    training_data_type train;
+    sequence_observations obs_dist{
+        num_states, num_actions, rng,
+        stats::dirichlet<state_id>{smoothing_constant, num_actions}};
+
+    return hmm_type{num_states, rng, std::move(obs_dist),
+                    stats::dirichlet<state_id>{smoothing_constant,
+                                               num_states}};
+}
+
+/**
+ * Reads the extracted sequences for each student from a stream of JSON
+ * lines, passing each student's sessions to fn and logging summary
+ * statistics at the end.
+ *
+ * @return the total number of sessions read
+ */
+template <class Function>
+uint64_t read_training_data(std::istream& input, Function&& fn)
+{
+    metrics::stage_timer timer{"read"};
+    auto& byte_count = metrics::get_counter("bytes");
+    auto& user_count = metrics::get_counter("users");
+    auto& sequence_count = metrics::get_counter("sequences");
 
     stats::running_stats stats;
     std::string line;
+    uint64_t num_users = 0;
     uint64_t total_sequences = 0;
-    while (std::getline(std::cin, line))
+    while (std::getline(input, line))
     {
+        byte_count += line.size() + 1;
         auto obj = json::parse(line);
-        usernames.push_back(obj["username"].get<std::string>());
+        ++num_users;
+        ++user_count;
 
         auto sequences = obj["sequences"].get<sequence_type>();
-        train.push_back(sequences);
-
         for (const auto& seq : sequences)
             stats.add(seq.size());
-
         total_sequences += sequences.size();
+        sequence_count += sequences.size();
+
+        fn(std::move(sequences));
     }
+    timer.stop();
 
     LOG(info) << "Training data consumed!" << ENDLG;
-    LOG(info) << "Users: " << usernames.size() << ENDLG;
+    LOG(info) << "Users: " << num_users << ENDLG;
     LOG(info) << "Sequences: " << total_sequences << ENDLG;
     LOG(info) << "Sequences per user: "
-              << static_cast<double>(total_sequences) / usernames.size()
-              << ENDLG;
+              << static_cast<double>(total_sequences) / num_users << ENDLG;
     LOG(info) << "Average sequence length: " << stats.mean() << ENDLG;
     LOG(info) << "Variance of sequence length: " << stats.variance() << ENDLG;
 
-    std::mt19937 rng{47};
+    return total_sequences;
+}
 
-    using namespace hmm;
+/**
+ * Writes a student's sessions in a compact binary form for streaming
+ * training: the number of sessions, then each session's length followed
+ * by its actions.
+ */
+void write_packed_instance(std::ostream& os, const sequence_type& instance)
+{
+    io::packed::write(os, static_cast<uint64_t>(instance.size()));
+    for (const auto& seq : instance)
+    {
+        io::packed::write(os, static_cast<uint64_t>(seq.size()));
+        for (const auto& action : seq)
+            io::packed::write(os, static_cast<uint64_t>(action));
+    }
+}
 
-    const uint64_t num_actions = 10;
-    const double smoothing_constant = 1e-6;
+/**
+ * Reads a student's sessions written by write_packed_instance.
+ * @return false at the end of the stream
+ */
+bool read_packed_instance(std::istream& is, sequence_type& instance)
+{
+    uint64_t num_sequences;
+    io::packed::read(is, num_sequences);
+    if (!is)
+        return false;
 
-    sequence_observations obs_dist{
-        num_states, num_actions, rng,
-        stats::dirichlet<state_id>{smoothing_constant, num_actions}};
+    instance.resize(num_sequences);
+    for (auto& seq : instance)
+    {
+        uint64_t length;
+        io::packed::read(is, length);
+        seq.resize(length);
+        for (auto& action : seq)
+        {
+            uint64_t aid;
+            io::packed::read(is, aid);
+            action = sequence::state_id{aid};
+        }
+    }
+    return static_cast<bool>(is);
+}
 
-    parallel::thread_pool pool;
-    hidden_markov_model<sequence_observations> hmm{
-        num_states, rng, std::move(obs_dist),
-        stats::dirichlet<state_id>{smoothing_constant, num_states}};
+struct restart_options
+{
+    /// The number of randomly initialized models to train
+    uint64_t restarts = 1;
+
+    /// The number of iterations after which to prune restarts that are
+    /// falling behind (0 disables pruning)
+    uint64_t prune_after = 0;
+
+    /// The number of restarts that survive pruning
+    uint64_t keep = 1;
+};
+
+struct restart
+{
+    uint64_t seed;
+    hmm_type model;
+    hmm_type::training_state state;
+};
+
+/**
+ * Creates a randomly initialized model along with its training state.
+ */
+restart make_restart(uint64_t num_states, uint64_t seed)
+{
+    hmm_type::training_state state;
+    state.rng.seed(seed);
+    auto model = make_model(num_states, state.rng);
+    return {seed, std::move(model), std::move(state)};
+}
+
+/**
+ * Loads a model and its training state from a checkpoint file.
+ */
+restart resume_restart(const std::string& filename, uint64_t num_states)
+{
+    io::gzifstream input{filename};
+    hmm_type model{input};
+    if (model.num_states() != num_states)
+    {
+        throw sequence::hmm::hmm_exception{
+            "checkpoint has " + std::to_string(model.num_states())
+            + " states, not " + std::to_string(num_states)};
+    }
+
+    hmm_type::training_state state;
+    state.load(input);
+    return {0, std::move(model), std::move(state)};
+}
+
+/**
+ * Runs fn on every restart concurrently. Each restart gets its own driver
+ * thread, but all of the forward-backward work is submitted to the shared
+ * pool, so restarts and sequences are interleaved on the same workers.
+ */
+template <class Function>
+void for_each_restart(std::vector<restart>& runs, Function&& fn)
+{
+    std::vector<std::thread> threads;
+    threads.reserve(runs.size());
+    for (auto& run : runs)
+        threads.emplace_back([&]() { fn(run); });
+    for (auto& thread : threads)
+        thread.join();
+}
+
+/**
+ * Trains opts.restarts models over the (shared, read-only) training data
+ * and returns the one with the highest log likelihood.
+ */
+restart train_restarts(uint64_t num_states, const training_data_type& train,
+                        parallel::thread_pool& pool,
+                        hmm_type::training_options options,
+                        const restart_options& opts)
+{
+    // restart r is seeded with 47 + r, so a single restart reproduces the
+    // original single-model run
+    std::vector<restart> runs;
+    runs.reserve(opts.restarts);
+    for (uint64_t r = 0; r < opts.restarts; ++r)
+        runs.push_back(make_restart(num_states, 47 + r));
+
+    if (opts.prune_after > 0 && opts.keep < runs.size()
+        && opts.prune_after < options.max_iters)
+    {
+        LOG(info) << "Training " << runs.size() << " restarts for "
+                  << opts.prune_after << " iterations..." << ENDLG;
+
+        auto prune_options = options;
+        prune_options.max_iters = opts.prune_after;
+        for_each_restart(runs, [&](restart& run) {
+            run.model.fit(train, pool, prune_options, run.state);
+        });
+
+        std::sort(runs.begin(), runs.end(),
+                  [](const restart& a, const restart& b) {
+                      return a.state.log_likelihood
+                             > b.state.log_likelihood;
+                  });
+
+        for (auto it = runs.begin() + opts.keep; it != runs.end(); ++it)
+        {
+            LOG(info) << "Pruning restart with seed " << it->seed
+                      << " (log likelihood " << it->state.log_likelihood
+                      << ")" << ENDLG;
+        }
+        runs.erase(runs.begin() + opts.keep, runs.end());
+    }
+
+    // survivors pick up where their training state left off
+    LOG(info) << "Training " << runs.size() << " restarts to convergence..."
+              << ENDLG;
+    for_each_restart(runs, [&](restart& run) {
+        run.model.fit(train, pool, options, run.state);
+    });
+
+    for (const auto& run : runs)
+    {
+        LOG(info) << "Restart with seed " << run.seed << ": log likelihood "
+                  << run.state.log_likelihood << ENDLG;
+    }
+
+    auto best = std::max_element(runs.begin(), runs.end(),
+                                 [](const restart& a, const restart& b) {
+                                     return a.state.log_likelihood
+                                            < b.state.log_likelihood;
+                                 });
+
+    LOG(info) << "Best restart: seed " << best->seed << " (log likelihood "
+              << best->state.log_likelihood << ")" << ENDLG;
+
+    return std::move(*best);
+}
+
+struct sweep_options
+{
+    /// The largest number of states to sweep to (0 disables the sweep)
+    uint64_t max_states = 0;
+
+    /// Whether to initialize the K + 1 state model by splitting a state of
+    /// the K state model instead of restarting from scratch
+    bool warm_start = false;
+};
+
+/**
+ * Finds the state with the largest mass in the stationary distribution of
+ * the hidden state Markov chain, using power iteration from the initial
+ * state distribution.
+ */
+sequence::state_id heaviest_state(const hmm_type& hmm)
+{
+    using sequence::state_id;
+
+    std::vector<double> dist(hmm.num_states());
+    for (state_id i{0}; i < hmm.num_states(); ++i)
+        dist[i] = hmm.init_prob(i);
+
+    std::vector<double> next(hmm.num_states());
+    for (uint64_t iter = 0; iter < 100; ++iter)
+    {
+        std::fill(next.begin(), next.end(), 0.0);
+        for (state_id i{0}; i < hmm.num_states(); ++i)
+        {
+            for (state_id j{0}; j < hmm.num_states(); ++j)
+                next[j] += dist[i] * hmm.trans_prob(i, j);
+        }
+        std::swap(dist, next);
+    }
+
+    return state_id{static_cast<uint64_t>(
+        std::max_element(dist.begin(), dist.end()) - dist.begin())};
+}
+
+/**
+ * Warm starts a model with one more hidden state by splitting the
+ * heaviest state of the given model in two. Transitions into the split
+ * state are divided evenly between its halves, both halves keep its
+ * outgoing transitions, and the new half gets a randomly perturbed copy
+ * of its observation distribution so that EM can pull them apart.
+ */
+hmm_type split_state(const hmm_type& hmm, std::mt19937& rng)
+{
+    using namespace sequence;
 
-    decltype(hmm)::training_options options;
+    auto split = heaviest_state(hmm);
+    auto num_states = hmm.num_states() + 1;
+    state_id added{hmm.num_states()};
+
+    LOG(info) << "Splitting state " << split << " to initialize "
+              << num_states << " state model" << ENDLG;
+
+    std::vector<double> init(num_states);
+    std::vector<std::vector<double>> trans(num_states,
+                                           std::vector<double>(num_states));
+    for (state_id i{0}; i < hmm.num_states(); ++i)
+    {
+        init[i] = hmm.init_prob(i);
+        for (state_id j{0}; j < hmm.num_states(); ++j)
+            trans[i][j] = hmm.trans_prob(i, j);
+        trans[i][added] = trans[i][split] /= 2;
+    }
+    init[added] = init[split] /= 2;
+    trans[added] = trans[split];
+
+    std::vector<markov_model> models;
+    models.reserve(num_states);
+    for (state_id s{0}; s < hmm.num_states(); ++s)
+        models.push_back(hmm.observation_distribution(s));
+
+    // perturb a copy of the split state's Markov model
+    std::uniform_real_distribution<double> jitter{0.9, 1.1};
+    const auto& mm = hmm.observation_distribution(split);
+    std::vector<double> mm_init(num_actions);
+    std::vector<std::vector<double>> mm_trans(num_actions,
+                                              std::vector<double>(num_actions));
+    for (state_id i{0}; i < num_actions; ++i)
+    {
+        mm_init[i] = mm.initial_probability(i) * jitter(rng);
+        for (state_id j{0}; j < num_actions; ++j)
+            mm_trans[i][j] = mm.transition_probability(i, j) * jitter(rng);
+    }
+    models.push_back(make_markov_model(
+        mm_init, mm_trans,
+        stats::dirichlet<state_id>{smoothing_constant, num_actions}));
+
+    return make_hmm<hmm_type>(
+        make_sequence_observations(models),
+        make_markov_model(init, trans, stats::dirichlet<state_id>{
+                                           smoothing_constant, num_states}));
+}
+
+/**
+ * The number of free parameters in a model with the given number of
+ * hidden states.
+ */
+uint64_t num_parameters(uint64_t num_states)
+{
+    auto markov_params = [](uint64_t n) { return (n - 1) + n * (n - 1); };
+    return markov_params(num_states) + num_states * markov_params(num_actions);
+}
+
+/**
+ * Trains a model for each number of hidden states in [num_states,
+ * opts.max_states], all over the same parsed training data, writing each
+ * to hmm-model-K.gz and a JSON summary line per model to stdout.
+ *
+ * BIC uses the number of sessions as the number of observations, since
+ * sessions are what the hidden states emit.
+ */
+void sweep(uint64_t num_states, const training_data_type& train,
+           uint64_t total_sequences, parallel::thread_pool& pool,
+           const hmm_type::training_options& options,
+           const restart_options& restart_opts, const sweep_options& opts)
+{
+    util::optional<hmm_type> previous;
+    for (uint64_t k = num_states; k <= opts.max_states; ++k)
+    {
+        LOG(info) << "Training model with " << k << " states..." << ENDLG;
+
+        util::optional<restart> result;
+        auto train_time = common::time([&]() {
+            if (opts.warm_start && previous)
+            {
+                hmm_type::training_state state;
+                state.rng.seed(47 + k);
+                auto hmm = split_state(*previous, state.rng);
+                hmm.fit(train, pool, options, state);
+                result = restart{47 + k, std::move(hmm), std::move(state)};
+            }
+            else
+            {
+                result = train_restarts(k, train, pool, options, restart_opts);
+            }
+        });
+
+        auto ll = result->state.log_likelihood;
+        auto params = num_parameters(k);
+        auto filename = "hmm-model-" + std::to_string(k) + ".gz";
+        {
+            io::gzofstream output{filename};
+            result->model.save(output);
+        }
+
+        std::cout << json{{"num_states", k},
+                          {"log_likelihood", ll},
+                          {"parameters", params},
+                          {"bic", -2 * ll
+                                      + params * std::log(static_cast<double>(
+                                                     total_sequences))},
+                          {"aic", -2 * ll + 2.0 * params},
+                          {"seconds", train_time.count() / 1000.0},
+                          {"model", filename}}
+                  << std::endl;
+
+        previous = std::move(result->model);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"clickstream-hmm"};
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " num_states [--restarts R] [--prune-after N] [--keep K]"
+                     " [--sweep-to K_max] [--warm-start] [--accelerate]"
+                     " [--checkpoint file] [--checkpoint-interval N]"
+                     " [--resume file] [--batch-size N] [--step-offset t0]"
+                     " [--step-exponent kappa] [--stream file]"
+                     " [--block-size N] [--coordinator address --workers N]"
+                     " [--worker address --rank r] [--single-precision]"
+                     " [--max-iters N]"
+                  << std::endl;
+        return 1;
+    };
+
+    if (argc < 2)
+        return usage();
+
+    uint64_t num_states = std::stoull(argv[1]);
+
+    restart_options restart_opts;
+    sweep_options sweep_opts;
+    hmm_type::training_options options;
     options.delta = 1e-4;
     options.max_iters = 50;
+    std::string resume_file;
+    std::string stream_file;
+    uint64_t block_size = 10000;
+    std::string coordinator_address;
+    std::string worker_address;
+    util::optional<uint64_t> worker_rank;
+    uint64_t num_workers = 0;
+    for (int i = 2; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (flag == "--warm-start")
+        {
+            sweep_opts.warm_start = true;
+            continue;
+        }
+
+        if (flag == "--accelerate")
+        {
+            options.accelerate = true;
+            continue;
+        }
+
+        if (flag == "--single-precision")
+        {
+            options.single_precision = true;
+            continue;
+        }
+
+        if (i + 1 == argc)
+            return usage();
+
+        if (flag == "--restarts")
+            restart_opts.restarts = std::stoull(argv[++i]);
+        else if (flag == "--prune-after")
+            restart_opts.prune_after = std::stoull(argv[++i]);
+        else if (flag == "--keep")
+            restart_opts.keep = std::stoull(argv[++i]);
+        else if (flag == "--sweep-to")
+            sweep_opts.max_states = std::stoull(argv[++i]);
+        else if (flag == "--checkpoint")
+            options.checkpoint_file = argv[++i];
+        else if (flag == "--checkpoint-interval")
+            options.checkpoint_interval = std::stoull(argv[++i]);
+        else if (flag == "--resume")
+            resume_file = argv[++i];
+        else if (flag == "--batch-size")
+            options.batch_size = std::stoull(argv[++i]);
+        else if (flag == "--step-offset")
+            options.step_offset = std::stod(argv[++i]);
+        else if (flag == "--step-exponent")
+            options.step_exponent = std::stod(argv[++i]);
+        else if (flag == "--stream")
+            stream_file = argv[++i];
+        else if (flag == "--block-size")
+            block_size = std::stoull(argv[++i]);
+        else if (flag == "--coordinator")
+            coordinator_address = argv[++i];
+        else if (flag == "--workers")
+            num_workers = std::stoull(argv[++i]);
+        else if (flag == "--worker")
+            worker_address = argv[++i];
+        else if (flag == "--rank")
+            worker_rank = std::stoull(argv[++i]);
+        else if (flag == "--max-iters")
+            options.max_iters = std::stoull(argv[++i]);
+        else
+            return usage();
+    }
+
+    if ((!options.checkpoint_file.empty() || !resume_file.empty())
+        && (restart_opts.restarts > 1 || sweep_opts.max_states > 0))
+    {
+        std::cerr << "Checkpointing is only supported when training a single "
+                     "model"
+                  << std::endl;
+        return 1;
+    }
+
+    if (!stream_file.empty()
+        && (restart_opts.restarts > 1 || sweep_opts.max_states > 0
+            || options.batch_size > 0 || options.accelerate))
+    {
+        std::cerr << "Streaming only supports plain batch EM on a single "
+                     "model"
+                  << std::endl;
+        return 1;
+    }
+
+    bool distributed = !coordinator_address.empty() || !worker_address.empty();
+    if (distributed
+        && (restart_opts.restarts > 1 || sweep_opts.max_states > 0
+            || options.batch_size > 0 || options.accelerate
+            || !stream_file.empty()))
+    {
+        std::cerr << "Distributed training only supports plain batch EM on a "
+                     "single model"
+                  << std::endl;
+        return 1;
+    }
+
+    if (!coordinator_address.empty() && num_workers == 0)
+    {
+        std::cerr << "The coordinator needs a positive number of workers"
+                  << std::endl;
+        return 1;
+    }
+
+    if (!worker_address.empty() && !worker_rank)
+    {
+        std::cerr << "Each worker needs its rank among the workers"
+                  << std::endl;
+        return 1;
+    }
+
+    if (options.accelerate && options.batch_size > 0)
+    {
+        std::cerr << "Online EM cannot be accelerated" << std::endl;
+        return 1;
+    }
+
+    if (options.checkpoint_interval == 0 || block_size == 0)
+    {
+        std::cerr << "Checkpoint interval and block size must be positive"
+                  << std::endl;
+        return 1;
+    }
+
+    if (restart_opts.restarts == 0 || restart_opts.keep == 0)
+    {
+        std::cerr << "Number of restarts and survivors must be positive"
+                  << std::endl;
+        return 1;
+    }
+
+    using namespace sequence;
+
+    parallel::thread_pool pool;
+    metrics::track_threads(pool);
+
+    if (!coordinator_address.empty())
+    {
+        // the coordinator holds no training data: the workers own it
+        auto run = resume_file.empty() ? make_restart(num_states, 47)
+                                       : resume_restart(resume_file,
+                                                        num_states);
+
+        LOG(info) << "Beginning distributed training..." << ENDLG;
+        run_em_coordinator(run.model, coordinator_address, num_workers,
+                           options, run.state);
+
+        LOG(info) << "Saving model..." << ENDLG;
+        io::gzofstream output{"hmm-model.gz"};
+        run.model.save(output);
+        return 0;
+    }
+
+    if (!stream_file.empty())
+    {
+        // spill the training data to a compact binary file, and stream it
+        // back in blocks on every iteration
+        uint64_t num_instances = 0;
+        {
+            std::ofstream packed{stream_file, std::ios::binary};
+            read_training_data(std::cin, [&](sequence_type&& instance) {
+                write_packed_instance(packed, instance);
+                ++num_instances;
+            });
+        }
+
+        std::ifstream packed{stream_file, std::ios::binary};
+        block_reader<sequence_type> blocks{packed, block_size,
+                                           read_packed_instance};
+
+        auto run = resume_file.empty() ? make_restart(num_states, 47)
+                                       : resume_restart(resume_file,
+                                                        num_states);
+
+        LOG(info) << "Beginning streaming training..." << ENDLG;
+        run.model.fit_stream(blocks, num_instances, pool, options, run.state);
+
+        LOG(info) << "Saving model..." << ENDLG;
+        io::gzofstream output{"hmm-model.gz"};
+        run.model.save(output);
+
+        filesystem::delete_file(stream_file);
+        return 0;
+    }
+
+    training_data_type train;
+    auto total_sequences
+        = read_training_data(std::cin, [&](sequence_type&& instance) {
+              train.push_back(std::move(instance));
+          });
+
+    if (!worker_address.empty())
+    {
+        run_em_worker<hmm_type>(train, worker_address, *worker_rank, pool);
+        return 0;
+    }
+
+    if (sweep_opts.max_states > 0)
+    {
+        LOG(info) << "Beginning sweep..." << ENDLG;
+        sweep(num_states, train, total_sequences, pool, options, restart_opts,
+              sweep_opts);
+        return 0;
+    }
+
+    if (!resume_file.empty())
+    {
+        auto run = resume_restart(resume_file, num_states);
+
+        LOG(info) << "Resuming training after iteration "
+                  << run.state.iteration << "..." << ENDLG;
+        run.model.fit(train, pool, options, run.state);
+
+        LOG(info) << "Saving model..." << ENDLG;
+        io::gzofstream output{"hmm-model.gz"};
+        run.model.save(output);
+        return 0;
+    }
 
     LOG(info) << "Beginning training..." << ENDLG;
-    hmm.fit(train, pool, options);
+    auto best = train_restarts(num_states, train, pool, options, restart_opts);
 
     LOG(info) << "Saving model..." << ENDLG;
     io::gzofstream output{"hmm-model.gz"};
-    hmm.save(output);
+    best.model.save(output);
 
     return 0;
 }
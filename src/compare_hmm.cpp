@@ -0,0 +1,132 @@
+/**
+ * @file compare_hmm.cpp
+ * Compares the parameters of two HMM model files with the same number of
+ * states, e.g. to validate a model trained with single-precision
+ * trellises against one trained in double precision from the same seed.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "json.hpp"
+#include "metrics.h"
+
+#include "meta/io/gzstream.h"
+#include "meta/logging/logger.h"
+#include "meta/sequence/hmm/hmm.h"
+#include "meta/sequence/hmm/sequence_observations.h"
+
+using namespace nlohmann;
+using namespace meta;
+
+/**
+ * Summary of the absolute differences between corresponding parameters.
+ */
+struct difference
+{
+    void add(double a, double b)
+    {
+        auto diff = std::abs(a - b);
+        max = std::max(max, diff);
+        sum += diff;
+        ++count;
+    }
+
+    difference& operator+=(const difference& other)
+    {
+        max = std::max(max, other.max);
+        sum += other.sum;
+        count += other.count;
+        return *this;
+    }
+
+    json to_json() const
+    {
+        return {{"max_abs_diff", max},
+                {"mean_abs_diff", count > 0 ? sum / count : 0.0},
+                {"parameters", count}};
+    }
+
+    double max = 0;
+    double sum = 0;
+    uint64_t count = 0;
+};
+
+void compare(const sequence::markov_model& a, const sequence::markov_model& b,
+             difference& initial, difference& transitions)
+{
+    using sequence::state_id;
+    for (state_id i{0}; i < a.num_states(); ++i)
+    {
+        initial.add(a.initial_probability(i), b.initial_probability(i));
+        for (state_id j{0}; j < a.num_states(); ++j)
+            transitions.add(a.transition_probability(i, j),
+                            b.transition_probability(i, j));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"compare-hmm"};
+
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " model-a.gz model-b.gz"
+                  << std::endl;
+        return 1;
+    }
+
+    using namespace sequence;
+    using namespace hmm;
+    using hmm_type = hidden_markov_model<sequence_observations>;
+
+    io::gzifstream input_a{argv[1]};
+    hmm_type a{input_a};
+    io::gzifstream input_b{argv[2]};
+    hmm_type b{input_b};
+
+    if (a.num_states() != b.num_states())
+    {
+        std::cerr << "The models have differing numbers of hidden states"
+                  << std::endl;
+        return 1;
+    }
+
+    difference initial;
+    difference transitions;
+    for (state_id i{0}; i < a.num_states(); ++i)
+    {
+        initial.add(a.init_prob(i), b.init_prob(i));
+        for (state_id j{0}; j < a.num_states(); ++j)
+            transitions.add(a.trans_prob(i, j), b.trans_prob(i, j));
+    }
+
+    difference obs_initial;
+    difference obs_transitions;
+    auto states = json::array();
+    for (state_id s{0}; s < a.num_states(); ++s)
+    {
+        difference state_initial;
+        difference state_transitions;
+        compare(a.observation_distribution(s), b.observation_distribution(s),
+                state_initial, state_transitions);
+        states.push_back({{"initial", state_initial.to_json()},
+                          {"transitions", state_transitions.to_json()}});
+
+        obs_initial += state_initial;
+        obs_transitions += state_transitions;
+    }
+
+    std::cout << json{{"num_states", a.num_states()},
+                      {"initial", initial.to_json()},
+                      {"transitions", transitions.to_json()},
+                      {"observations",
+                       {{"initial", obs_initial.to_json()},
+                        {"transitions", obs_transitions.to_json()},
+                        {"states", states}}}}
+                     .dump(4)
+              << std::endl;
+
+    return 0;
+}
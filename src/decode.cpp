@@ -4,107 +4,279 @@
  * Given lists of sequences for individual students, computes the
  * (average) latent state probability and (average) latent state
  * transition probability for each student using the forward-backward
- * algorithm on a pre-trained HMM.
+ * algorithm on a pre-trained HMM. Several models can be given, in which
+ * case each student is parsed once and decoded against all of them, and
+ * output probabilities are shared between models with identical
+ * observation distributions. rank-students and classify-students read
+ * one model's posteriors from such output with --model.
+ *
+ * Students are decoded in parallel, in chunks of lines, and written out
+ * as line-delimited JSON in input order. At most a fixed number of chunks
+ * are in flight at once, so memory use does not grow with the input.
  */
 
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <iterator>
+#include <numeric>
+#include <sstream>
+#include <thread>
+
 #include "json.hpp"
+#include "metrics.h"
+#include "retrofit_hmm.h"
 
 #include "meta/io/gzstream.h"
 #include "meta/logging/logger.h"
-#include "meta/sequence/hmm/hmm.h"
+#include "meta/parallel/thread_pool.h"
 #include "meta/sequence/hmm/sequence_observations.h"
 #include "meta/util/identifiers.h"
+#include "meta/util/string_view.h"
 
 using namespace nlohmann;
 using namespace meta;
 
-int main(int argc, char** argv)
+using hmm_type
+    = sequence::hmm::hidden_markov_model<sequence::hmm::sequence_observations>;
+
+/**
+ * A model to decode against.
+ */
+struct decode_model
 {
-    logging::set_cerr_logging();
+    decode_model(const std::string& file) : filename{file}, hmm{load(file)}
+    {
+        trans = hmm.transition_matrix();
+    }
 
-    if (argc != 2)
+    static hmm_type load(const std::string& file)
     {
-        std::cerr << "Usage: " << argv[0] << " model.gz" << std::endl;
-        return 1;
+        io::gzifstream input{file};
+        return hmm_type{input};
     }
 
+    std::string filename;
+    hmm_type hmm;
+    std::vector<double> trans;
+
+    /// The first model with the same observation distribution as this one
+    uint64_t emissions = 0;
+};
+
+/**
+ * Points each model at the first model with an identical observation
+ * distribution, so that output probabilities are computed once per
+ * distinct distribution.
+ */
+void share_emissions(std::vector<decode_model>& models)
+{
+    std::vector<std::string> serialized;
+    for (uint64_t m = 0; m < models.size(); ++m)
+    {
+        std::ostringstream os;
+        models[m].hmm.observation_distribution().save(os);
+        serialized.push_back(os.str());
+
+        models[m].emissions
+            = static_cast<uint64_t>(std::distance(
+                serialized.begin(), std::find(serialized.begin(),
+                                              serialized.end(), os.str())));
+        if (models[m].emissions != m)
+            LOG(info) << models[m].filename << " shares its emissions with "
+                      << models[models[m].emissions].filename << ENDLG;
+    }
+}
+
+/**
+ * Normalizes summed posteriors into a student's average state
+ * distribution and transition matrix.
+ */
+json posteriors(uint64_t num_states, std::vector<double>& state_probs,
+                const std::vector<double>& trans_sums)
+{
+    auto denom = std::accumulate(state_probs.begin(), state_probs.end(), 0.0);
+    std::transform(state_probs.begin(), state_probs.end(), state_probs.begin(),
+                   [=](double val) { return val / denom; });
+
+    std::vector<std::vector<double>> transitions(num_states);
+    for (uint64_t i = 0; i < num_states; ++i)
+    {
+        auto begin = trans_sums.begin() + i * num_states;
+        auto end = begin + num_states;
+        auto denom = std::accumulate(begin, end, 0.0);
+        transitions[i].reserve(num_states);
+        std::transform(begin, end, std::back_inserter(transitions[i]),
+                       [=](double val) { return val / denom; });
+    }
+
+    return {{"state_probs", state_probs}, {"transitions", transitions}};
+}
+
+/**
+ * Decodes the student on one line of input against every model into one
+ * line of output. With a single model, the posteriors are top-level
+ * fields; otherwise they are listed per model under "models".
+ */
+template <class Real>
+std::string decode_student(const std::vector<decode_model>& models,
+                           const std::string& line)
+{
     using namespace sequence;
-    using namespace hmm;
     using action_sequence_type = std::vector<state_id>;
     using sequence_type = std::vector<action_sequence_type>;
-    using hmm_type = hidden_markov_model<sequence_observations>;
-    using fwdbwd = logarithm_forward_backward;
 
-    io::gzifstream input{argv[1]};
-    hmm_type hmm{input};
+    auto obj = json::parse(line);
 
-    auto arr = json::array();
-    std::string line;
-    while (std::getline(std::cin, line))
+    auto sequences = obj["sequences"].get<sequence_type>();
+
+    std::vector<std::vector<Real>> outputs(models.size());
+    std::vector<double> log_scales(models.size());
+    auto results = json::array();
+    for (uint64_t m = 0; m < models.size(); ++m)
     {
-        auto obj = json::parse(line);
+        const auto& model = models[m];
+        if (model.emissions == m)
+            log_scales[m]
+                = model.hmm.output_probabilities(sequences, outputs[m]);
+
+        auto num_states = model.hmm.num_states();
+        std::vector<double> state_probs(num_states);
+        std::vector<double> trans_sums(num_states * num_states);
+        auto log_likelihood
+            = log_scales[model.emissions]
+              + model.hmm.posterior_sums(outputs[model.emissions], model.trans,
+                                         state_probs, trans_sums);
+
+        auto result = posteriors(num_states, state_probs, trans_sums);
+        result["log_likelihood"] = log_likelihood;
+        results.push_back(std::move(result));
+    }
 
-        auto sequences = obj["sequences"].get<sequence_type>();
+    if (models.size() == 1)
+    {
+        auto result = std::move(results[0]);
+        result["username"] = obj["username"].get<std::string>();
+        return result.dump();
+    }
 
-        // run forward-backward to get state and trans probabilities
-        auto output_log_probs = fwdbwd::output_probabilities(hmm, sequences);
+    for (uint64_t m = 0; m < models.size(); ++m)
+        results[m]["model"] = models[m].filename;
+    return json{{"username", obj["username"].get<std::string>()},
+                {"models", results}}
+        .dump();
+}
 
-        auto fwd = fwdbwd::forward(hmm, sequences, output_log_probs);
-        auto bwd = fwdbwd::backward(hmm, sequences, fwd, output_log_probs);
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"decode"};
 
-        auto log_gamma = fwdbwd::posterior_state_membership(hmm, fwd, bwd);
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " model.gz [model.gz...] [--single-precision]"
+                     " [--chunk-size N]"
+                  << std::endl;
+        return 1;
+    };
 
-        std::vector<double> state_probs(hmm.num_states());
-        for (state_id i{0}; i < hmm.num_states(); ++i)
+    bool single_precision = false;
+    uint64_t chunk_size = 256;
+    std::vector<std::string> model_files;
+    for (int i = 1; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (flag.substr(0, 2) != "--")
         {
-            state_probs[i] = 0.0;
-            for (uint64_t t = 0; t < sequences.size(); ++t)
-            {
-                state_probs[i] += std::exp(log_gamma(t, i));
-            }
+            model_files.emplace_back(argv[i]);
+            continue;
         }
 
-        auto denom
-            = std::accumulate(state_probs.begin(), state_probs.end(), 0.0);
-        std::transform(state_probs.begin(), state_probs.end(),
-                       state_probs.begin(),
-                       [=](double val) { return val / denom; });
-
-        std::vector<std::vector<double>> transitions(hmm.num_states());
-        for (label_id i{0}; i < hmm.num_states(); ++i)
+        if (flag == "--single-precision")
         {
-            state_id s_i{i};
+            single_precision = true;
+            continue;
+        }
 
-            transitions[i].resize(hmm.num_states());
+        if (i + 1 == argc)
+            return usage();
 
-            for (label_id j{0}; j < hmm.num_states(); ++j)
-            {
-                state_id s_j{j};
+        if (flag == "--chunk-size")
+            chunk_size = std::stoull(argv[++i]);
+        else
+            return usage();
+    }
 
-                for (uint64_t t = 0; t < sequences.size() - 1; ++t)
-                {
-                    auto log_xi_tij
-                        = log_gamma(t, s_i) + std::log(hmm.trans_prob(s_i, s_j))
-                          + output_log_probs(t + 1, s_j)
-                          + bwd.probability(t + 1, j) - bwd.probability(t, i);
+    if (model_files.empty())
+        return usage();
 
-                    transitions[i][j] += std::exp(log_xi_tij);
-                }
-            }
+    if (chunk_size == 0)
+    {
+        std::cerr << "Chunk size must be positive" << std::endl;
+        return 1;
+    }
+
+    metrics::stage_timer load_timer{"load_models"};
+    std::vector<decode_model> models;
+    models.reserve(model_files.size());
+    for (const auto& file : model_files)
+        models.emplace_back(file);
+    share_emissions(models);
+    load_timer.stop();
+
+    auto& student_count = metrics::get_counter("students");
+    auto& byte_count = metrics::get_counter("bytes");
+    // summed over the workers, so this can exceed the wall time
+    auto& decode_stage = metrics::get_stage("decode");
 
-            auto denom = std::accumulate(transitions[i].begin(),
-                                         transitions[i].end(), 0.0);
-            std::transform(transitions[i].begin(), transitions[i].end(),
-                           transitions[i].begin(),
-                           [=](double val) { return val / denom; });
+    parallel::thread_pool pool;
+    metrics::track_threads(pool);
+
+    // the reorder buffer: chunks are written out in the order they were
+    // read, so a slow chunk holds back the ones behind it until it is done
+    auto max_pending
+        = 2 * std::max<uint64_t>(std::thread::hardware_concurrency(), 1);
+    std::deque<std::future<std::string>> pending;
+    auto write_oldest = [&]() {
+        std::cout << pending.front().get();
+        pending.pop_front();
+    };
+
+    std::string line;
+    while (std::cin)
+    {
+        std::vector<std::string> lines;
+        lines.reserve(chunk_size);
+        while (lines.size() < chunk_size && std::getline(std::cin, line))
+        {
+            byte_count += line.size() + 1;
+            lines.push_back(std::move(line));
         }
+        if (lines.empty())
+            break;
+        student_count += lines.size();
+
+        if (pending.size() == max_pending)
+            write_oldest();
 
-        arr.push_back({{"username", obj["username"].get<std::string>()},
-                       {"state_probs", state_probs},
-                       {"transitions", transitions}});
+        pending.push_back(pool.submit_task(
+            [&models, &decode_stage, single_precision,
+             lines = std::move(lines)]() {
+                metrics::stage_timer timer{decode_stage};
+                std::string output;
+                for (const auto& line : lines)
+                {
+                    output += single_precision
+                                  ? decode_student<float>(models, line)
+                                  : decode_student<double>(models, line);
+                    output += '\n';
+                }
+                return output;
+            }));
     }
 
-    std::cout << arr << "\n";
+    while (!pending.empty())
+        write_oldest();
 
     return 0;
 }
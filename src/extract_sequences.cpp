@@ -2,13 +2,21 @@
  * @file extract_sequences.cpp
  * Extracts each browsing session for each user given a Coursera
  * clickstream dump.
+ *
+ * A new session starts when a user has been idle for longer than the
+ * session gap (10 hours by default). Several gaps can be given, in which
+ * case the dump is read and each event is classified only once. Each
+ * user's actions are stored once, with where each session starts under
+ * each gap.
  */
 
+#include <fstream>
 #include <iostream>
 #include <regex>
 #include <string>
 
 #include "json.hpp"
+#include "metrics.h"
 
 #include "meta/hashing/probe_map.h"
 #include "meta/io/filesystem.h"
@@ -19,6 +27,7 @@
 #include "meta/util/multiway_merge.h"
 #include "meta/util/optional.h"
 #include "meta/util/progress.h"
+#include "meta/util/string_view.h"
 
 using namespace nlohmann;
 using namespace meta;
@@ -54,7 +63,27 @@ struct student_record
 struct memory_student_record
 {
     uint64_t last_action_time = 0;
-    std::vector<action_sequence> sequences;
+    /// every action of the user, which all gaps share
+    action_sequence actions;
+    /// the position in actions where each session starts, under each gap
+    std::vector<std::vector<uint64_t>> session_starts;
+
+    /**
+     * @return the sessions of this user under the gth gap
+     */
+    std::vector<action_sequence> sequences(uint64_t g) const
+    {
+        const auto& starts = session_starts[g];
+        std::vector<action_sequence> seqs;
+        seqs.reserve(starts.size());
+        for (uint64_t i = 0; i < starts.size(); ++i)
+        {
+            auto end = i + 1 < starts.size() ? starts[i + 1] : actions.size();
+            seqs.emplace_back(actions.begin() + starts[i],
+                              actions.begin() + end);
+        }
+        return seqs;
+    }
 };
 
 util::optional<action_id> get_action(const std::string& str)
@@ -91,61 +120,145 @@ util::optional<action_id> get_action(const std::string& str)
 using student_record_map
     = hashing::probe_map<std::string, memory_student_record>;
 
+/**
+ * @param gaps The session gaps, in milliseconds
+ */
 void insert_new_action(student_record_map& store, const std::string& username,
-                       action_id aid, uint64_t timestamp)
+                       action_id aid, uint64_t timestamp,
+                       const std::vector<uint64_t>& gaps)
 {
     auto it = store.find(username);
     if (it == store.end())
-        it = store.insert(username, memory_student_record{});
-
-    // if the last action was more than 10 hours ago, this is the start
-    // of a new sequence
-    if (timestamp > it->value().last_action_time + 10 * 60 * 60 * 1000)
     {
-        it->value().sequences.emplace_back(1, aid);
+        memory_student_record record;
+        record.session_starts.resize(gaps.size());
+        it = store.insert(username, std::move(record));
     }
-    // otherwise, this is just another action of the current sequence
-    else
+
+    auto& record = it->value();
+    for (uint64_t g = 0; g < gaps.size(); ++g)
     {
-        it->value().sequences.back().push_back(aid);
+        // if the last action was more than a gap ago, this is the start
+        // of a new sequence; otherwise, this is just another action of
+        // the current sequence
+        if (record.actions.empty()
+            || timestamp > record.last_action_time + gaps[g])
+            record.session_starts[g].push_back(record.actions.size());
     }
 
-    it->value().last_action_time = timestamp;
+    record.actions.push_back(aid);
+    record.last_action_time = timestamp;
 }
 
-int main()
+int main(int argc, char** argv)
 {
     logging::set_cerr_logging();
 
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0] << " [--gap hours output.json]..."
+                  << std::endl;
+        return 1;
+    };
+
+    // with no gaps given, sessions split after 10 hours and are written to
+    // stdout
+    std::vector<uint64_t> gaps;
+    std::vector<std::string> outputs;
+    for (int i = 1; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (flag != "--gap" || i + 2 >= argc)
+            return usage();
+
+        auto hours = std::stod(argv[i + 1]);
+        if (hours < 0)
+        {
+            std::cerr << "Session gaps cannot be negative" << std::endl;
+            return 1;
+        }
+        gaps.push_back(static_cast<uint64_t>(hours * 60 * 60 * 1000));
+        outputs.emplace_back(argv[i + 2]);
+        i += 2;
+    }
+    if (gaps.empty())
+    {
+        gaps.push_back(10 * 60 * 60 * 1000);
+        outputs.emplace_back("");
+    }
+
+    // opened before reading, so that a bad path fails right away
+    std::vector<std::ofstream> files(outputs.size());
+    for (uint64_t g = 0; g < outputs.size(); ++g)
+    {
+        if (outputs[g].empty())
+            continue;
+        files[g].open(outputs[g]);
+        if (!files[g])
+        {
+            std::cerr << "Could not open " << outputs[g] << std::endl;
+            return 1;
+        }
+    }
+
+    metrics::session session{"extract-sequences"};
+    auto& line_count = metrics::get_counter("lines");
+    auto& byte_count = metrics::get_counter("bytes");
+    auto& pageview_count = metrics::get_counter("pageviews");
+    auto& action_count = metrics::get_counter("actions");
+
     student_record_map store;
     std::string line;
+    metrics::stage_timer read_timer{"read"};
     while (std::getline(std::cin, line))
     {
+        ++line_count;
+        byte_count += line.size() + 1;
         auto obj = json::parse(line);
         if (obj["key"].get<std::string>() != util::string_view{"pageview"})
             continue;
+        ++pageview_count;
         auto username = obj["username"].get<std::string>();
         auto timestamp = obj["timestamp"].get<uint64_t>();
         // new dumps appear to set some cleaned url in "value"; use that if
-        // we can
-        if (auto action = get_action(obj["value"].get<std::string>()))
+        // we can, and otherwise use the value in page_url, which always
+        // exists
+        auto action = get_action(obj["value"].get<std::string>());
+        if (!action)
+            action = get_action(obj["page_url"].get<std::string>());
+        if (action)
         {
-            insert_new_action(store, username, *action, timestamp);
-        }
-        // otherwise use the value in page_url, which always exists
-        else if (auto action = get_action(obj["page_url"].get<std::string>()))
-        {
-            insert_new_action(store, username, *action, timestamp);
+            insert_new_action(store, username, *action, timestamp, gaps);
+            ++action_count;
         }
     }
+    read_timer.stop();
 
-    for (const auto& pr : store)
+    metrics::stage_timer write_timer{"write"};
+    for (uint64_t g = 0; g < gaps.size(); ++g)
     {
-        auto obj = json::object();
-        obj["username"] = pr.key();
-        obj["sequences"] = pr.value().sequences;
+        std::ostream& output = outputs[g].empty() ? std::cout : files[g];
+
+        for (const auto& pr : store)
+        {
+            auto obj = json::object();
+            obj["username"] = pr.key();
+            obj["sequences"] = pr.value().sequences(g);
+
+            output << obj << '\n';
+        }
+
+        if (!output)
+        {
+            std::cerr << "Failed to write "
+                      << (outputs[g].empty() ? "stdout" : outputs[g])
+                      << std::endl;
+            return 1;
+        }
 
-        std::cout << obj << '\n';
+        if (!outputs[g].empty())
+            LOG(info) << "Wrote sessions for a gap of "
+                      << gaps[g] / (60 * 60 * 1000.0) << " hours to "
+                      << outputs[g] << ENDLG;
     }
 
     return 0;
@@ -0,0 +1,308 @@
+/**
+ * @file filter_server.cpp
+ *
+ * A long-running server that tracks the filtered latent state
+ * distribution of each student as their sessions arrive, without
+ * re-decoding their whole history. Clients connect over a socket and send
+ * one JSON request per line:
+ *
+ *  - {"command": "update", "username": u, "session": [actions]} folds a
+ *    completed session into the student's state;
+ *  - {"command": "get", "username": u} looks up the student's state;
+ *  - {"command": "snapshot"} writes every student's state to disk.
+ *
+ * Each request gets a one-line JSON reply: the student's filtered state
+ * distribution, number of sessions and log likelihood so far, or an
+ * "error" message.
+ */
+
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include "json.hpp"
+#include "metrics.h"
+#include "retrofit_hmm.h"
+#include "socket_stream.h"
+
+#include "meta/hashing/probe_map.h"
+#include "meta/io/filesystem.h"
+#include "meta/io/gzstream.h"
+#include "meta/io/packed.h"
+#include "meta/logging/logger.h"
+#include "meta/sequence/hmm/sequence_observations.h"
+#include "meta/util/identifiers.h"
+#include "meta/util/string_view.h"
+
+using namespace nlohmann;
+using namespace meta;
+
+using hmm_type
+    = sequence::hmm::hidden_markov_model<sequence::hmm::sequence_observations>;
+using action_sequence_type = std::vector<sequence::state_id>;
+
+/**
+ * The forward messages of every student seen so far: the normalized
+ * forward probabilities (the filtered state distribution) after their
+ * latest session, and the log likelihood of their sessions so far. The
+ * messages are stored contiguously, indexed through a hash table from
+ * username to student number.
+ */
+class filter_table
+{
+  public:
+    filter_table(const hmm_type& hmm)
+        : hmm_(hmm),
+          trans_{hmm.transition_matrix()},
+          num_actions_{hmm.observation_distribution(0).num_states()}
+    {
+        // nothing
+    }
+
+    /**
+     * Folds a completed session into the student's state.
+     */
+    json update(const std::string& username,
+                const action_sequence_type& session)
+    {
+        if (session.empty())
+            throw std::invalid_argument{"empty session"};
+        for (const auto& action : session)
+        {
+            if (action >= num_actions_)
+                throw std::invalid_argument{"invalid action id "
+                                            + std::to_string(action)};
+        }
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto it = index_.find(username);
+        auto first = it == index_.end();
+        uint64_t student = first ? add_student(username) : it->value();
+
+        log_likelihood_[student] += hmm_.filter(
+            session, trans_, &alpha_[student * hmm_.num_states()], first);
+        ++sessions_[student];
+        return to_json(student);
+    }
+
+    /**
+     * Looks up the student's state.
+     */
+    json get(const std::string& username) const
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto it = index_.find(username);
+        if (it == index_.end())
+            throw std::invalid_argument{"unknown student " + username};
+        return to_json(it->value());
+    }
+
+    /**
+     * Atomically writes every student's state to the given file.
+     */
+    void save(const std::string& filename) const
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+
+        auto tmp_filename = filename + ".tmp";
+        {
+            io::gzofstream output{tmp_filename};
+            io::packed::write(output, hmm_.num_states());
+            io::packed::write(output, static_cast<uint64_t>(usernames_.size()));
+            for (uint64_t student = 0; student < usernames_.size(); ++student)
+            {
+                io::packed::write(output, usernames_[student]);
+                io::packed::write(output, sessions_[student]);
+                io::packed::write(output, log_likelihood_[student]);
+                for (uint64_t s = 0; s < hmm_.num_states(); ++s)
+                    io::packed::write(
+                        output, alpha_[student * hmm_.num_states() + s]);
+            }
+        }
+
+        if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+            throw std::runtime_error{"failed to write snapshot " + filename};
+
+        LOG(info) << "Snapshotted " << usernames_.size() << " students to "
+                  << filename << ENDLG;
+    }
+
+    /**
+     * Replaces the table with a snapshot written by save().
+     */
+    void load(const std::string& filename)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+
+        io::gzifstream input{filename};
+        uint64_t num_states;
+        uint64_t num_students;
+        io::packed::read(input, num_states);
+        io::packed::read(input, num_students);
+        if (num_states != hmm_.num_states())
+            throw std::runtime_error{"snapshot " + filename
+                                     + " was made with a model with "
+                                     + std::to_string(num_states)
+                                     + " states"};
+
+        index_ = hashing::probe_map<std::string, uint64_t>{};
+        usernames_.clear();
+        sessions_.clear();
+        log_likelihood_.clear();
+        alpha_.clear();
+        for (uint64_t student = 0; student < num_students; ++student)
+        {
+            std::string username;
+            io::packed::read(input, username);
+            add_student(username);
+            io::packed::read(input, sessions_[student]);
+            io::packed::read(input, log_likelihood_[student]);
+            for (uint64_t s = 0; s < num_states; ++s)
+                io::packed::read(input, alpha_[student * num_states + s]);
+        }
+
+        LOG(info) << "Loaded " << num_students << " students from "
+                  << filename << ENDLG;
+    }
+
+  private:
+    uint64_t add_student(const std::string& username)
+    {
+        uint64_t student = usernames_.size();
+        index_[username] = student;
+        usernames_.push_back(username);
+        sessions_.push_back(0);
+        log_likelihood_.push_back(0.0);
+        alpha_.resize(alpha_.size() + hmm_.num_states());
+        return student;
+    }
+
+    json to_json(uint64_t student) const
+    {
+        auto begin = alpha_.begin() + student * hmm_.num_states();
+        return {{"username", usernames_[student]},
+                {"sessions", sessions_[student]},
+                {"log_likelihood", log_likelihood_[student]},
+                {"state_probs", std::vector<double>(
+                                    begin, begin + hmm_.num_states())}};
+    }
+
+    const hmm_type& hmm_;
+    const std::vector<double> trans_;
+    const uint64_t num_actions_;
+
+    mutable std::mutex mutex_;
+    hashing::probe_map<std::string, uint64_t> index_;
+    std::vector<std::string> usernames_;
+    std::vector<uint64_t> sessions_;
+    std::vector<double> log_likelihood_;
+    std::vector<double> alpha_;
+};
+
+/**
+ * Answers requests from one client until it disconnects.
+ */
+void serve(int fd, filter_table& table, const std::string& snapshot_file)
+{
+    static auto& request_count = metrics::get_counter("requests");
+    static auto& error_count = metrics::get_counter("errors");
+    // fixed names, so that clients cannot add stages to the registry
+    static auto& update_time = metrics::get_stage("update");
+    static auto& get_time = metrics::get_stage("get");
+    static auto& snapshot_time = metrics::get_stage("snapshot");
+    ++metrics::get_counter("connections");
+
+    net::socket_stream conn{fd};
+    std::string line;
+    while (std::getline(conn, line))
+    {
+        ++request_count;
+        json response;
+        try
+        {
+            auto request = json::parse(line);
+            auto command = request.value("command", std::string{"update"});
+            if (command == "update")
+            {
+                metrics::stage_timer timer{update_time};
+                response = table.update(
+                    request["username"].get<std::string>(),
+                    request["session"].get<action_sequence_type>());
+            }
+            else if (command == "get")
+            {
+                metrics::stage_timer timer{get_time};
+                response = table.get(request["username"].get<std::string>());
+            }
+            else if (command == "snapshot")
+            {
+                metrics::stage_timer timer{snapshot_time};
+                if (snapshot_file.empty())
+                    throw std::invalid_argument{"no snapshot file configured"};
+                table.save(snapshot_file);
+                response = {{"snapshot", snapshot_file}};
+            }
+            else
+                throw std::invalid_argument{"unknown command " + command};
+        }
+        catch (const std::exception& ex)
+        {
+            ++error_count;
+            response = {{"error", ex.what()}};
+        }
+
+        conn << response.dump() << "\n";
+        conn.flush();
+        if (!conn)
+            break;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    // the server never exits, so its metrics are only written by the
+    // periodic dumps (see CLICKSTREAM_METRICS_INTERVAL)
+    metrics::session session{"filter-server"};
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " model.gz address [--snapshot file]" << std::endl;
+        return 1;
+    };
+
+    if (argc < 3)
+        return usage();
+
+    std::string snapshot_file;
+    for (int i = 3; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (i + 1 == argc)
+            return usage();
+
+        if (flag == "--snapshot")
+            snapshot_file = argv[++i];
+        else
+            return usage();
+    }
+
+    io::gzifstream input{argv[1]};
+    const hmm_type hmm{input};
+
+    filter_table table{hmm};
+    if (!snapshot_file.empty() && filesystem::exists(snapshot_file))
+        table.load(snapshot_file);
+
+    net::socket_listener listener{argv[2]};
+    LOG(info) << "Listening on " << argv[2] << "..." << ENDLG;
+    while (true)
+    {
+        auto fd = listener.accept();
+        std::thread{[fd, &table, &snapshot_file]() {
+            serve(fd, table, snapshot_file);
+        }}.detach();
+    }
+
+    return 0;
+}
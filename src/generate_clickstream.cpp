@@ -0,0 +1,498 @@
+/**
+ * @file generate_clickstream.cpp
+ * Generates a synthetic Coursera clickstream dump, for benchmarking and
+ * testing the pipeline without access to real data.
+ *
+ * Each user is active for a number of sessions separated by long gaps,
+ * and each session is a run of page views a few seconds to minutes
+ * apart. Page views are drawn from every URL class recognized by
+ * extract-sequences (plus URLs it ignores), either from a fixed mix or
+ * by sampling sessions from a trained hidden Markov model. Some lines are
+ * other kinds of events, some are truncated, and timestamps can be
+ * jittered so the output is only approximately sorted.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sstream>
+
+#include "json.hpp"
+#include "metrics.h"
+#include "retrofit_hmm.h"
+
+#include "meta/io/gzstream.h"
+#include "meta/logging/logger.h"
+#include "meta/sequence/hmm/sequence_observations.h"
+#include "meta/util/identifiers.h"
+#include "meta/util/optional.h"
+#include "meta/util/string_view.h"
+
+using namespace nlohmann;
+using namespace meta;
+
+using hmm_type
+    = sequence::hmm::hidden_markov_model<sequence::hmm::sequence_observations>;
+
+const uint64_t num_actions = 10;
+
+/**
+ * The class of URL for a page view: one of the actions recognized by
+ * extract-sequences, or num_actions for a URL it ignores.
+ */
+using url_class = uint64_t;
+
+struct generator_options
+{
+    /// The number of distinct users
+    uint64_t users = 1000;
+
+    /// The (approximate) total number of page views
+    uint64_t events = 100000;
+
+    /// The relative frequency of each URL class
+    std::array<double, num_actions + 1> mix
+        = {{3, 5, 20, 1, 0.5, 2, 40, 6, 5, 7, 10}};
+
+    /// The mean number of page views in a session
+    double session_length = 8;
+
+    /// The fraction of lines that are events other than page views
+    double other_rate = 0.2;
+
+    /// The fraction of lines that are truncated
+    double bad_rate = 0.001;
+
+    /// The largest amount, in milliseconds, by which a timestamp may be
+    /// moved from its true value
+    uint64_t skew = 0;
+
+    uint64_t seed = 47;
+};
+
+/**
+ * A page view before it is formatted.
+ */
+struct event
+{
+    uint64_t timestamp;
+    uint32_t user;
+    uint32_t url;
+};
+
+bool operator<(const event& a, const event& b)
+{
+    return a.timestamp < b.timestamp;
+}
+
+/**
+ * Samples the URL classes of each session of a user.
+ */
+class session_sampler
+{
+  public:
+    virtual ~session_sampler() = default;
+
+    /**
+     * Starts a new user.
+     */
+    virtual void start_user(std::mt19937_64& rng) = 0;
+
+    /**
+     * Samples one session of the given length.
+     */
+    virtual void sample(std::mt19937_64& rng, uint64_t length,
+                        std::vector<url_class>& session)
+        = 0;
+};
+
+/**
+ * Draws each page view independently from the configured mix, except
+ * that a page view repeats the previous one half of the time.
+ */
+class mix_sampler : public session_sampler
+{
+  public:
+    mix_sampler(const generator_options& options)
+        : urls_{options.mix.begin(), options.mix.end()}
+    {
+        // nothing
+    }
+
+    void start_user(std::mt19937_64&) override
+    {
+        // nothing
+    }
+
+    void sample(std::mt19937_64& rng, uint64_t length,
+                std::vector<url_class>& session) override
+    {
+        std::bernoulli_distribution repeat{0.5};
+        session.clear();
+        for (uint64_t t = 0; t < length; ++t)
+        {
+            if (t > 0 && repeat(rng))
+                session.push_back(session.back());
+            else
+                session.push_back(urls_(rng));
+        }
+    }
+
+  private:
+    std::discrete_distribution<url_class> urls_;
+};
+
+/**
+ * Samples sessions from a hidden Markov model: the hidden state moves
+ * once per session, and each session's actions are drawn from the Markov
+ * model of its hidden state. Ignored URLs are mixed in at the rate given
+ * by the configured mix.
+ */
+class hmm_sampler : public session_sampler
+{
+  public:
+    hmm_sampler(const hmm_type& hmm, const generator_options& options)
+        : ignored_{options.mix[num_actions]
+                   / std::accumulate(options.mix.begin(), options.mix.end(),
+                                     0.0)}
+    {
+        using sequence::state_id;
+        if (hmm.observation_distribution(state_id{0}).num_states()
+            != num_actions)
+        {
+            throw std::invalid_argument{"model does not have "
+                                        + std::to_string(num_actions)
+                                        + " actions"};
+        }
+
+        std::vector<double> probs(hmm.num_states());
+        for (state_id s{0}; s < hmm.num_states(); ++s)
+            probs[s] = hmm.init_prob(s);
+        init_ = {probs.begin(), probs.end()};
+
+        for (state_id i{0}; i < hmm.num_states(); ++i)
+        {
+            for (state_id j{0}; j < hmm.num_states(); ++j)
+                probs[j] = hmm.trans_prob(i, j);
+            trans_.emplace_back(probs.begin(), probs.end());
+        }
+
+        probs.resize(num_actions);
+        for (state_id s{0}; s < hmm.num_states(); ++s)
+        {
+            const auto& mm = hmm.observation_distribution(s);
+            for (state_id a{0}; a < num_actions; ++a)
+                probs[a] = mm.initial_probability(a);
+            action_init_.emplace_back(probs.begin(), probs.end());
+
+            action_trans_.emplace_back();
+            for (state_id a{0}; a < num_actions; ++a)
+            {
+                for (state_id b{0}; b < num_actions; ++b)
+                    probs[b] = mm.transition_probability(a, b);
+                action_trans_.back().emplace_back(probs.begin(), probs.end());
+            }
+        }
+    }
+
+    void start_user(std::mt19937_64&) override
+    {
+        state_ = util::nullopt;
+    }
+
+    void sample(std::mt19937_64& rng, uint64_t length,
+                std::vector<url_class>& session) override
+    {
+        state_ = state_ ? trans_[*state_](rng) : init_(rng);
+
+        session.clear();
+        util::optional<url_class> action;
+        for (uint64_t t = 0; t < length; ++t)
+        {
+            if (ignored_(rng))
+            {
+                session.push_back(num_actions);
+                continue;
+            }
+
+            action = action ? action_trans_[*state_][*action](rng)
+                            : action_init_[*state_](rng);
+            session.push_back(*action);
+        }
+    }
+
+  private:
+    using distribution = std::discrete_distribution<uint64_t>;
+
+    std::bernoulli_distribution ignored_;
+    distribution init_;
+    std::vector<distribution> trans_;
+    std::vector<distribution> action_init_;
+    std::vector<std::vector<distribution>> action_trans_;
+    util::optional<uint64_t> state_;
+};
+
+/**
+ * Generates every page view, in timestamp order.
+ */
+std::vector<event> generate_events(const generator_options& options,
+                                   session_sampler& sampler,
+                                   std::mt19937_64& rng)
+{
+    // the course runs for ten weeks, starting on Jan 1, 2013
+    const uint64_t course_start = 1356998400000;
+    const uint64_t course_length = 10ull * 7 * 24 * 60 * 60 * 1000;
+    const uint64_t hour = 60 * 60 * 1000;
+
+    // users are unevenly active: each gets a share of the page views
+    // proportional to a log-normal weight
+    std::lognormal_distribution<double> activity{0, 1};
+    std::vector<double> weights(options.users);
+    for (auto& weight : weights)
+        weight = activity(rng);
+    auto total_weight = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+    std::geometric_distribution<uint64_t> extra_length{
+        1 / std::max(options.session_length, 1.0)};
+    std::uniform_int_distribution<uint64_t> start{0, course_length};
+    // sessions are at least 10 hours apart (the gap extract-sequences
+    // splits on), typically a day or two
+    std::exponential_distribution<double> session_gap{1.0 / (36 * hour)};
+    // page views within a session are seconds to minutes apart
+    std::exponential_distribution<double> view_gap{1.0 / 45000};
+
+    std::vector<event> events;
+    events.reserve(options.events + options.events / 10);
+    std::vector<url_class> session;
+    for (uint64_t u = 0; u < options.users; ++u)
+    {
+        auto budget = static_cast<uint64_t>(
+            std::ceil(options.events * weights[u] / total_weight));
+
+        sampler.start_user(rng);
+        auto time = course_start + start(rng) / 2;
+        while (budget > 0)
+        {
+            auto length = std::min(budget, 1 + extra_length(rng));
+            sampler.sample(rng, length, session);
+            for (const auto& url : session)
+            {
+                events.push_back({time, static_cast<uint32_t>(u),
+                                  static_cast<uint32_t>(url)});
+                time += 1000 + static_cast<uint64_t>(view_gap(rng));
+            }
+            budget -= length;
+            time += 10 * hour + static_cast<uint64_t>(session_gap(rng));
+        }
+    }
+
+    std::sort(events.begin(), events.end());
+    return events;
+}
+
+/**
+ * Formats the URL path for a page view of the given class.
+ */
+std::string url_path(url_class url, std::mt19937_64& rng)
+{
+    std::uniform_int_distribution<uint64_t> id{1, 500};
+    auto n = std::to_string(id(rng));
+    switch (url)
+    {
+        case 0:
+            return "/forum/list";
+        case 1:
+            return "/forum/list?forum_id=" + n;
+        case 2:
+            return "/forum/thread?thread_id=" + n;
+        case 3:
+            return "/forum/search?q=week+" + n;
+        case 4:
+            return "/forum/posted_thread";
+        case 5:
+            return "/forum/posted_reply";
+        case 6:
+        {
+            // downloading or one of the streaming player's URLs
+            static const std::array<const char*, 3> prefixes
+                = {{"/lecture/download.mp4?lecture_id=",
+                    "/lecture?lecture_id=", "/lecture/view?lecture_id="}};
+            return prefixes[id(rng) % prefixes.size()] + n;
+        }
+        case 7:
+            return "/quiz/start?quiz_id=" + n;
+        case 8:
+            return "/quiz/submit";
+        case 9:
+            return "/wiki/view?page=week" + n;
+        default:
+        {
+            static const std::array<const char*, 4> ignored
+                = {{"/", "/class/index", "/human_grading/", "/auth/welcome"}};
+            return ignored[id(rng) % ignored.size()];
+        }
+    }
+}
+
+/**
+ * Writes the dump as JSON lines, mixing in other events, truncated lines,
+ * and timestamp jitter.
+ */
+void write_events(const std::vector<event>& events,
+                  const generator_options& options, std::mt19937_64& rng)
+{
+    const std::string base = "https://class.coursera.org/synthetic-001";
+
+    std::vector<std::string> usernames(options.users);
+    std::uniform_int_distribution<uint64_t> hex_digit{0, 15};
+    for (auto& username : usernames)
+    {
+        for (uint64_t i = 0; i < 40; ++i)
+            username.push_back("0123456789abcdef"[hex_digit(rng)]);
+    }
+
+    std::bernoulli_distribution other{options.other_rate};
+    std::bernoulli_distribution bad{options.bad_rate};
+    std::bernoulli_distribution cleaned{0.5};
+    std::uniform_int_distribution<int64_t> jitter{
+        -static_cast<int64_t>(options.skew),
+        static_cast<int64_t>(options.skew)};
+
+    auto& line_count = metrics::get_counter("lines");
+    auto& bad_line_count = metrics::get_counter("bad_lines");
+    auto write = [&](json& obj) {
+        auto line = obj.dump();
+        if (bad(rng))
+        {
+            line.resize(line.size() / 2);
+            ++bad_line_count;
+        }
+        ++line_count;
+        std::cout << line << '\n';
+    };
+
+    for (const auto& ev : events)
+    {
+        auto timestamp = static_cast<uint64_t>(
+            std::max<int64_t>(0, static_cast<int64_t>(ev.timestamp)
+                                     + jitter(rng)));
+        const auto& username = usernames[ev.user];
+
+        if (other(rng))
+        {
+            json obj = {{"key", "user.video.lecture.action"},
+                        {"value", "{\"currentTime\":12.5,\"playbackRate\":1}"},
+                        {"username", username},
+                        {"timestamp", timestamp},
+                        {"page_url", base + "/lecture/view?lecture_id=1"},
+                        {"session", "synthetic"},
+                        {"language", "en-US"}};
+            write(obj);
+        }
+
+        auto path = url_path(ev.url, rng);
+        // newer dumps set a cleaned URL in "value"; older ones leave it
+        // empty
+        json obj = {{"key", "pageview"},
+                    {"value", cleaned(rng) ? path : ""},
+                    {"username", username},
+                    {"timestamp", timestamp},
+                    {"page_url", base + path},
+                    {"session", "synthetic"},
+                    {"language", "en-US"}};
+        write(obj);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"generate-clickstream"};
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--users N] [--events N] [--mix w0,...,w10]"
+                     " [--session-length L] [--other-rate p] [--bad-rate p]"
+                     " [--skew ms] [--model hmm-model.gz] [--seed s]"
+                  << std::endl;
+        return 1;
+    };
+
+    generator_options options;
+    std::string model_file;
+    for (int i = 1; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (i + 1 == argc)
+            return usage();
+
+        if (flag == "--users")
+            options.users = std::stoull(argv[++i]);
+        else if (flag == "--events")
+            options.events = std::stoull(argv[++i]);
+        else if (flag == "--mix")
+        {
+            std::istringstream weights{argv[++i]};
+            std::string weight;
+            for (auto& w : options.mix)
+            {
+                if (!std::getline(weights, weight, ','))
+                    return usage();
+                w = std::stod(weight);
+            }
+        }
+        else if (flag == "--session-length")
+            options.session_length = std::stod(argv[++i]);
+        else if (flag == "--other-rate")
+            options.other_rate = std::stod(argv[++i]);
+        else if (flag == "--bad-rate")
+            options.bad_rate = std::stod(argv[++i]);
+        else if (flag == "--skew")
+            options.skew = std::stoull(argv[++i]);
+        else if (flag == "--model")
+            model_file = argv[++i];
+        else if (flag == "--seed")
+            options.seed = std::stoull(argv[++i]);
+        else
+            return usage();
+    }
+
+    if (options.users == 0
+        || options.users > std::numeric_limits<uint32_t>::max())
+    {
+        std::cerr << "The number of users must be positive and fit in 32 "
+                     "bits"
+                  << std::endl;
+        return 1;
+    }
+
+    std::mt19937_64 rng{options.seed};
+
+    std::unique_ptr<session_sampler> sampler;
+    if (model_file.empty())
+    {
+        sampler = std::make_unique<mix_sampler>(options);
+    }
+    else
+    {
+        io::gzifstream input{model_file};
+        hmm_type hmm{input};
+        sampler = std::make_unique<hmm_sampler>(hmm, options);
+    }
+
+    LOG(info) << "Generating events for " << options.users << " users..."
+              << ENDLG;
+    metrics::stage_timer generate_timer{"generate"};
+    auto events = generate_events(options, *sampler, rng);
+    generate_timer.stop();
+
+    LOG(info) << "Writing " << events.size() << " page views..." << ENDLG;
+    metrics::stage_timer write_timer{"write"};
+    write_events(events, options, rng);
+
+    return 0;
+}
@@ -0,0 +1,523 @@
+/**
+ * @file merge_sorted.cpp
+ * Merges Coursera clickstream json files that are each (nearly) sorted by
+ * the timestamp key into one sorted stream.
+ *
+ * Each input is first checked for sortedness by measuring its lateness:
+ * how far each line's timestamp falls behind the largest timestamp before
+ * it. Inputs whose lateness fits in the reorder window are streamed
+ * through a small buffer that holds lines until nothing later in the
+ * input can precede them. Inputs that are too far out of order are sorted
+ * in memory if they fit in the --memory budget, and otherwise in sorted
+ * chunks of that size that are written to tmp/ and merged as they are
+ * read, as sort does. The inputs are then merged in one pass.
+ *
+ * With --dedup, a line identical to one already written with the same
+ * timestamp is dropped; lines are compared by hash, and byte by byte only
+ * when the hashes match.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+#include "metrics.h"
+
+#include "meta/io/filesystem.h"
+#include "meta/io/gzstream.h"
+#include "meta/io/packed.h"
+#include "meta/logging/logger.h"
+#include "meta/util/string_view.h"
+
+using namespace nlohmann;
+using namespace meta;
+
+struct timed_line
+{
+    uint64_t timestamp;
+    /// the position of the line in its input, to keep ties stable
+    uint64_t position;
+    std::string line;
+};
+
+/**
+ * Orders lines so that a max-heap built with it has the earliest line on
+ * top.
+ */
+bool later(const timed_line& a, const timed_line& b)
+{
+    return std::tie(a.timestamp, a.position)
+           > std::tie(b.timestamp, b.position);
+}
+
+/**
+ * Reads the lines of one input, skipping lines that are not valid json or
+ * have no timestamp.
+ */
+class line_reader
+{
+  public:
+    /**
+     * @param filename The input, or - for stdin
+     * @param report Whether to log bad lines and count the lines read;
+     * false for the sortedness check, so each line is reported once
+     */
+    line_reader(const std::string& filename, bool report = true)
+        : filename_{filename}, report_{report}
+    {
+        if (filename == "-")
+            return;
+
+        util::string_view name{filename};
+        if (name.size() > 3 && name.substr(name.size() - 3) == ".gz")
+            owned_ = std::make_unique<io::gzifstream>(filename);
+        else
+            owned_ = std::make_unique<std::ifstream>(filename);
+
+        if (!*owned_)
+            throw std::runtime_error{"could not open " + filename};
+    }
+
+    bool next(timed_line& out)
+    {
+        static auto& line_count = metrics::get_counter("lines");
+        static auto& byte_count = metrics::get_counter("bytes");
+        static auto& bad_line_count = metrics::get_counter("bad_lines");
+
+        auto& input = owned_ ? *owned_ : std::cin;
+        while (std::getline(input, out.line))
+        {
+            ++lineno_;
+            if (report_)
+            {
+                ++line_count;
+                byte_count += out.line.size() + 1;
+            }
+            try
+            {
+                out.timestamp
+                    = json::parse(out.line)["timestamp"].get<uint64_t>();
+                out.position = lineno_;
+                return true;
+            }
+            catch (const std::exception& ex)
+            {
+                if (!report_)
+                    continue;
+                ++bad_line_count;
+                LOG(error) << filename_ << " line " << lineno_ << ": "
+                           << ex.what() << ENDLG;
+            }
+        }
+        return false;
+    }
+
+  private:
+    std::string filename_;
+    bool report_;
+    std::unique_ptr<std::istream> owned_;
+    uint64_t lineno_ = 0;
+};
+
+/**
+ * Measures the largest amount, in milliseconds, by which a line of the
+ * input precedes a line before it (zero for a sorted input).
+ */
+uint64_t lateness(const std::string& filename)
+{
+    line_reader reader{filename, false};
+    timed_line tl;
+    uint64_t latest = 0;
+    uint64_t max_lateness = 0;
+    while (reader.next(tl))
+    {
+        if (tl.timestamp < latest)
+            max_lateness = std::max(max_lateness, latest - tl.timestamp);
+        latest = std::max(latest, tl.timestamp);
+    }
+    return max_lateness;
+}
+
+/**
+ * A source of lines in timestamp order.
+ */
+class sorted_source
+{
+  public:
+    virtual ~sorted_source() = default;
+
+    /**
+     * @return false once the source is exhausted
+     */
+    virtual bool next(timed_line& out) = 0;
+};
+
+/**
+ * Streams an input whose lateness is at most the window. A line is only
+ * released once a line at least window later has been read, at which
+ * point no line still to come can precede it.
+ */
+class window_source : public sorted_source
+{
+  public:
+    window_source(const std::string& filename, uint64_t window)
+        : filename_{filename}, reader_{filename}, window_{window}
+    {
+        // nothing
+    }
+
+    bool next(timed_line& out) override
+    {
+        while (!done_
+               && (heap_.empty()
+                   || heap_.front().timestamp + window_ > latest_))
+        {
+            timed_line tl;
+            if (!reader_.next(tl))
+            {
+                done_ = true;
+                break;
+            }
+            latest_ = std::max(latest_, tl.timestamp);
+            heap_.push_back(std::move(tl));
+            std::push_heap(heap_.begin(), heap_.end(), later);
+        }
+
+        if (heap_.empty())
+            return false;
+
+        std::pop_heap(heap_.begin(), heap_.end(), later);
+        out = std::move(heap_.back());
+        heap_.pop_back();
+
+        // only possible for inputs that could not be checked in advance
+        if (out.timestamp < released_)
+        {
+            throw std::runtime_error{
+                filename_ + " is out of order by more than the "
+                + std::to_string(window_) + " ms reorder window"};
+        }
+        released_ = out.timestamp;
+        return true;
+    }
+
+  private:
+    std::string filename_;
+    line_reader reader_;
+    uint64_t window_;
+    std::vector<timed_line> heap_;
+    uint64_t latest_ = 0;
+    uint64_t released_ = 0;
+    bool done_ = false;
+};
+
+/**
+ * Sorts an input that is too far out of order to stream. Lines are read
+ * into memory until they reach the memory budget; each full buffer is
+ * sorted and written to a chunk file, and the chunks are merged as lines
+ * are asked for. An input that fits in the budget is never written out.
+ */
+class external_source : public sorted_source
+{
+  public:
+    /**
+     * @param filename The input
+     * @param prefix The start of the name of each chunk file, which must
+     * be unique to this input
+     * @param max_bytes The most memory to use for lines being sorted
+     */
+    external_source(const std::string& filename, const std::string& prefix,
+                    uint64_t max_bytes)
+    {
+        metrics::stage_timer timer{"sort"};
+        line_reader reader{filename};
+        timed_line tl;
+        uint64_t bytes = 0;
+        while (reader.next(tl))
+        {
+            bytes += sizeof(timed_line) + tl.line.capacity();
+            lines_.push_back(std::move(tl));
+            if (bytes >= max_bytes)
+            {
+                flush_chunk(prefix);
+                bytes = 0;
+            }
+        }
+
+        if (chunks_.empty())
+        {
+            sort_lines();
+            return;
+        }
+
+        if (!lines_.empty())
+            flush_chunk(prefix);
+
+        // the head of each chunk, in a heap with the earliest on top
+        heads_.resize(chunks_.size());
+        for (uint64_t c = 0; c < chunks_.size(); ++c)
+        {
+            if (read_line(chunks_[c], heads_[c]))
+                heap_.push_back(c);
+        }
+        std::make_heap(heap_.begin(), heap_.end(), chunk_later{heads_});
+    }
+
+    ~external_source()
+    {
+        for (const auto& name : chunk_names_)
+            filesystem::delete_file(name);
+    }
+
+    bool next(timed_line& out) override
+    {
+        if (chunks_.empty())
+        {
+            if (pos_ == lines_.size())
+                return false;
+            out = std::move(lines_[pos_++]);
+            return true;
+        }
+
+        if (heap_.empty())
+            return false;
+
+        std::pop_heap(heap_.begin(), heap_.end(), chunk_later{heads_});
+        auto c = heap_.back();
+        out = std::move(heads_[c]);
+        if (read_line(chunks_[c], heads_[c]))
+            std::push_heap(heap_.begin(), heap_.end(), chunk_later{heads_});
+        else
+            heap_.pop_back();
+        return true;
+    }
+
+  private:
+    void sort_lines()
+    {
+        std::sort(lines_.begin(), lines_.end(),
+                  [](const timed_line& a, const timed_line& b) {
+                      return later(b, a);
+                  });
+    }
+
+    void flush_chunk(const std::string& prefix)
+    {
+        static auto& chunk_count = metrics::get_counter("sort_chunks");
+        ++chunk_count;
+
+        sort_lines();
+        if (!filesystem::exists("tmp"))
+            filesystem::make_directory("tmp");
+
+        chunk_names_.push_back("tmp/" + prefix + "-"
+                               + std::to_string(chunk_names_.size()));
+        {
+            std::ofstream chunk{chunk_names_.back(), std::ios::binary};
+            for (const auto& tl : lines_)
+            {
+                io::packed::write(chunk, tl.timestamp);
+                io::packed::write(chunk, tl.position);
+                io::packed::write(chunk, tl.line);
+            }
+            if (!chunk)
+            {
+                throw std::runtime_error{"could not write "
+                                         + chunk_names_.back()};
+            }
+        }
+
+        lines_.clear();
+        lines_.shrink_to_fit();
+        chunks_.emplace_back(chunk_names_.back(), std::ios::binary);
+    }
+
+    static bool read_line(std::ifstream& chunk, timed_line& out)
+    {
+        if (chunk.peek() == std::ifstream::traits_type::eof())
+            return false;
+        io::packed::read(chunk, out.timestamp);
+        io::packed::read(chunk, out.position);
+        io::packed::read(chunk, out.line);
+        return true;
+    }
+
+    /**
+     * Orders chunks so that a max-heap built with it has the chunk with
+     * the earliest head on top.
+     */
+    struct chunk_later
+    {
+        const std::vector<timed_line>& heads;
+
+        bool operator()(uint64_t a, uint64_t b) const
+        {
+            return later(heads[a], heads[b]);
+        }
+    };
+
+    /// the lines of the chunk being filled, or of the whole input if it
+    /// fit in memory
+    std::vector<timed_line> lines_;
+    uint64_t pos_ = 0;
+
+    std::vector<std::string> chunk_names_;
+    std::vector<std::ifstream> chunks_;
+    std::vector<timed_line> heads_;
+    std::vector<uint64_t> heap_;
+};
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"merge-sorted"};
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--window ms] [--memory GB] [--dedup] input[.gz]..."
+                  << std::endl
+                  << "An input of - reads stdin, which cannot be checked in "
+                     "advance and so must be within the window"
+                  << std::endl;
+        return 1;
+    };
+
+    uint64_t window = 5 * 60 * 1000;
+    uint64_t max_ram = 2ull * 1024 * 1024 * 1024;
+    bool dedup = false;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (flag == "--dedup")
+        {
+            dedup = true;
+        }
+        else if (flag == "--window")
+        {
+            if (i + 1 == argc)
+                return usage();
+            window = std::stoull(argv[++i]);
+        }
+        else if (flag == "--memory")
+        {
+            if (i + 1 == argc)
+                return usage();
+            max_ram = static_cast<uint64_t>(std::stod(argv[++i]) * 1024
+                                            * 1024 * 1024);
+        }
+        else
+        {
+            inputs.emplace_back(argv[i]);
+        }
+    }
+
+    if (inputs.empty())
+        return usage();
+
+    std::vector<std::unique_ptr<sorted_source>> sources;
+    {
+        metrics::stage_timer timer{"check"};
+        for (uint64_t n = 0; n < inputs.size(); ++n)
+        {
+            const auto& input = inputs[n];
+            if (input == "-")
+            {
+                LOG(info) << "stdin: unchecked, assuming it is within the "
+                             "window"
+                          << ENDLG;
+                sources.push_back(
+                    std::make_unique<window_source>(input, window));
+                continue;
+            }
+
+            auto late = lateness(input);
+            if (late <= window)
+            {
+                LOG(info) << input << ": " << (late ? "nearly " : "")
+                          << "sorted (lateness " << late << " ms)" << ENDLG;
+                sources.push_back(
+                    std::make_unique<window_source>(input, window));
+            }
+            else
+            {
+                LOG(info) << input << ": out of order by up to " << late
+                          << " ms, sorting" << ENDLG;
+                sources.push_back(std::make_unique<external_source>(
+                    input, "merge-" + std::to_string(n), max_ram));
+            }
+        }
+    }
+
+    // the head of each source, in a heap with the earliest on top; ties
+    // go to the earlier input
+    auto& duplicate_count = metrics::get_counter("duplicates");
+    metrics::stage_timer timer{"merge"};
+    std::vector<timed_line> heads(sources.size());
+    std::vector<uint64_t> heap;
+    auto earlier = [&](uint64_t a, uint64_t b) {
+        return std::tie(heads[a].timestamp, a)
+               > std::tie(heads[b].timestamp, b);
+    };
+    for (uint64_t s = 0; s < sources.size(); ++s)
+    {
+        if (sources[s]->next(heads[s]))
+            heap.push_back(s);
+    }
+    std::make_heap(heap.begin(), heap.end(), earlier);
+
+    // the hashes and lines written with the latest timestamp, which are
+    // the only ones a new line can duplicate
+    std::vector<std::pair<uint64_t, std::string>> written;
+    uint64_t last_timestamp = 0;
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), earlier);
+        auto s = heap.back();
+        if (!dedup)
+        {
+            std::cout << heads[s].line << '\n';
+        }
+        else
+        {
+            auto& head = heads[s];
+            if (!written.empty() && head.timestamp != last_timestamp)
+                written.clear();
+            last_timestamp = head.timestamp;
+
+            auto hash = std::hash<util::string_view>{}(head.line);
+            auto duplicate = std::any_of(
+                written.begin(), written.end(), [&](const auto& prev) {
+                    return prev.first == hash && prev.second == head.line;
+                });
+            if (duplicate)
+            {
+                ++duplicate_count;
+            }
+            else
+            {
+                std::cout << head.line << '\n';
+                written.emplace_back(hash, std::move(head.line));
+            }
+        }
+
+        if (sources[s]->next(heads[s]))
+            std::push_heap(heap.begin(), heap.end(), earlier);
+        else
+            heap.pop_back();
+    }
+
+    if (dedup)
+    {
+        LOG(info) << "Removed " << duplicate_count.value()
+                  << " duplicate lines" << ENDLG;
+    }
+    return 0;
+}
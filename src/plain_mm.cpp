@@ -2,18 +2,31 @@
  * @file plain_mm.cpp
  * Fits a markov model to extracted sequences for students from a Coursera
  * clickstream dump.
+ *
+ * The input is streamed and counted by several threads, so memory use
+ * does not depend on the size of the input. Models for any number of
+ * cohorts (given as lists of usernames) are fit in the same pass as the
+ * model for all students. With --order n (other than 1), the models are
+ * n-th order Markov models that back off to lower orders.
  */
 
+#include <algorithm>
 #include <array>
 #include <exception>
+#include <fstream>
+#include <mutex>
+#include <thread>
 
 #include "json.hpp"
 
-#include "meta/io/gzstream.h"
+#include "meta/hashing/probe_map.h"
 #include "meta/logging/logger.h"
 #include "meta/sequence/markov_model.h"
-#include "meta/stats/running_stats.h"
 #include "meta/util/identifiers.h"
+#include "meta/util/string_view.h"
+
+#include "higher_order_markov_model.h"
+#include "metrics.h"
 
 using namespace nlohmann;
 using namespace meta;
@@ -55,73 +68,281 @@ util::string_view action_name(sequence::state_id aid)
     return actions[aid];
 }
 
-int main()
+/**
+ * Statistics about the sequences consumed by one worker.
+ */
+struct sequence_stats
 {
-    logging::set_cerr_logging();
+    sequence_stats& operator+=(const sequence_stats& other)
+    {
+        users += other.users;
+        sequences += other.sequences;
+        actions += other.actions;
+        squared_lengths += other.squared_lengths;
+        return *this;
+    }
 
+    uint64_t users = 0;
+    uint64_t sequences = 0;
+    uint64_t actions = 0;
+    double squared_lengths = 0;
+};
+
+json model_json(const sequence::markov_model& mm)
+{
+    using sequence::state_id;
+    auto arr = json::array();
+    for (state_id i{0}; i < mm.num_states(); ++i)
+    {
+        auto trans = json::array();
+        for (state_id j{0}; j < mm.num_states(); ++j)
+        {
+            trans.push_back(mm.transition_probability(i, j));
+        }
+
+        arr.push_back({{"name", action_name(i).to_string()},
+                       {"init", mm.initial_probability(i)},
+                       {"edges", trans}});
+    }
+    return arr;
+}
+
+json model_json(const sequence::higher_order_markov_model& mm)
+{
+    using sequence::state_id;
+    auto contexts = mm.contexts();
+    std::sort(contexts.begin(), contexts.end());
+
+    auto arr = json::array();
+    for (const auto& key : contexts)
+    {
+        auto context = json::array();
+        for (const auto& action : mm.unpack(key))
+        {
+            if (action == mm.num_actions())
+                context.push_back("<start>");
+            else
+                context.push_back(action_name(state_id{action}).to_string());
+        }
+
+        auto probs = mm.context_distribution(key);
+        arr.push_back(
+            {{"context", context},
+             {"edges", std::vector<double>(probs, probs + mm.num_actions())}});
+    }
+    return arr;
+}
+
+/**
+ * Streams the extracted sequences on standard input into counts for
+ * every cohort. Each worker parses and counts blocks of lines into its
+ * own counts, which are merged once all of the input has been consumed.
+ *
+ * @param prototype Empty counts to copy for each cohort
+ * @param memberships The cohorts (as a bitmask) of each listed student;
+ * every student is in cohort 0
+ * @param num_cohorts The number of cohorts, including cohort 0
+ * @param total Statistics about the consumed sequences
+ * @return the counts for each cohort
+ */
+template <class Counts>
+std::vector<Counts>
+count_cohorts(const Counts& prototype,
+              const hashing::probe_map<std::string, uint64_t>& memberships,
+              uint64_t num_cohorts, sequence_stats& total)
+{
     using namespace sequence;
     using action_sequence_type = std::vector<state_id>;
     using sequence_type = std::vector<action_sequence_type>;
-    using training_data_type = std::vector<sequence_type>;
 
-    std::vector<std::string> usernames;
-    training_data_type train;
+    metrics::stage_timer timer{"count"};
+    auto& byte_count = metrics::get_counter("bytes");
+    const uint64_t block_size = 1024;
+    auto num_workers = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::vector<Counts>> counts(
+        num_workers, std::vector<Counts>(num_cohorts, prototype));
+    std::vector<sequence_stats> stats(num_workers);
+    std::mutex input_mutex;
 
-    stats::running_stats stats;
-    std::string line;
-    uint64_t total_sequences = 0;
-    while (std::getline(std::cin, line))
-    {
-        auto obj = json::parse(line);
-        usernames.push_back(obj["username"].get<std::string>());
+    auto work = [&](uint64_t worker) {
+        std::vector<std::string> lines;
+        while (true)
+        {
+            lines.clear();
+            {
+                std::lock_guard<std::mutex> lock{input_mutex};
+                std::string line;
+                while (lines.size() < block_size
+                       && std::getline(std::cin, line))
+                    lines.push_back(std::move(line));
+            }
+            if (lines.empty())
+                return;
 
-        auto sequences = obj["sequences"].get<sequence_type>();
-        train.push_back(sequences);
+            for (const auto& line : lines)
+            {
+                byte_count += line.size() + 1;
+                auto obj = json::parse(line);
+                auto username = obj["username"].get<std::string>();
+                auto sequences = obj["sequences"].get<sequence_type>();
 
-        for (const auto& seq : sequences)
-            stats.add(seq.size());
+                // every student is in the first cohort
+                uint64_t member = 1;
+                auto it = memberships.find(username);
+                if (it != memberships.end())
+                    member |= it->value();
 
-        total_sequences += sequences.size();
-    }
+                for (uint64_t c = 0; c < num_cohorts; ++c)
+                {
+                    if (!(member & (uint64_t{1} << c)))
+                        continue;
+                    for (const auto& seq : sequences)
+                        counts[worker][c].increment(seq, 1.0);
+                }
 
-    LOG(info) << "Training data consumed!" << ENDLG;
-    LOG(info) << "Users: " << usernames.size() << ENDLG;
-    LOG(info) << "Sequences: " << total_sequences << ENDLG;
-    LOG(info) << "Sequences per user: "
-              << static_cast<double>(total_sequences) / usernames.size()
-              << ENDLG;
-    LOG(info) << "Average sequence length: " << stats.mean() << ENDLG;
-    LOG(info) << "Variance of sequence length: " << stats.variance() << ENDLG;
+                ++stats[worker].users;
+                stats[worker].sequences += sequences.size();
+                for (const auto& seq : sequences)
+                {
+                    stats[worker].actions += seq.size();
+                    stats[worker].squared_lengths
+                        += static_cast<double>(seq.size()) * seq.size();
+                }
+            }
+        }
+    };
 
-    const uint64_t num_actions = 10;
-    const double smoothing_constant = 1e-6;
+    std::vector<std::thread> workers;
+    for (uint64_t w = 0; w < num_workers; ++w)
+        workers.emplace_back(work, w);
+    for (auto& worker : workers)
+        worker.join();
 
-    markov_model::expected_counts_type counts{num_actions,
-        stats::dirichlet<state_id>{smoothing_constant, num_actions}};
+    for (uint64_t w = 1; w < num_workers; ++w)
+    {
+        stats[0] += stats[w];
+        for (uint64_t c = 0; c < num_cohorts; ++c)
+            counts[0][c] += counts[w][c];
+    }
+    total = stats[0];
+    metrics::get_counter("users") += total.users;
+    metrics::get_counter("sequences") += total.sequences;
+    metrics::get_counter("actions") += total.actions;
+    return std::move(counts[0]);
+}
 
-    for (const auto& user_seqs : train)
+/**
+ * Fits a model to each cohort's counts and writes it as JSON, to standard
+ * output for cohort 0 and to the cohort's output file otherwise.
+ */
+template <class Model, class Counts>
+void write_models(std::vector<Counts>& counts,
+                  const std::vector<std::string>& outputs)
+{
+    metrics::stage_timer timer{"estimate"};
+    for (uint64_t c = 0; c < outputs.size(); ++c)
     {
-        for (const auto& seq : user_seqs)
+        Model mm{std::move(counts[c])};
+        if (outputs[c].empty())
         {
-            counts.increment(seq, 1.0);
+            std::cout << model_json(mm) << "\n";
+        }
+        else
+        {
+            std::ofstream output{outputs[c]};
+            output << model_json(mm) << "\n";
+            LOG(info) << "Wrote cohort model to " << outputs[c] << ENDLG;
         }
     }
+}
 
-    markov_model mm{std::move(counts)};
-    auto arr = json::array();
-    for (state_id i{0}; i < mm.num_states(); ++i)
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"plain-mm"};
+
+    using namespace sequence;
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--order n] [--cohort usernames.txt output.json]..."
+                  << std::endl;
+        return 1;
+    };
+
+    const uint64_t num_actions = 10;
+    const double smoothing_constant = 1e-6;
+    const stats::dirichlet<state_id> prior{smoothing_constant, num_actions};
+
+    // the first "cohort" is every student, and is written to stdout
+    std::vector<std::string> outputs{""};
+    hashing::probe_map<std::string, uint64_t> memberships;
+    uint64_t order = 1;
+    for (int i = 1; i < argc; ++i)
     {
-        auto trans = json::array();
-        for (state_id j{0}; j < mm.num_states(); ++j)
+        util::string_view flag{argv[i]};
+        if (flag == "--order" && i + 1 < argc)
         {
-            trans.push_back(mm.transition_probability(i, j));
+            order = std::stoull(argv[++i]);
+            continue;
         }
 
-        arr.push_back({{"name", action_name(i).to_string()},
-                       {"init", mm.initial_probability(i)},
-                       {"edges", trans}});
+        if (flag != "--cohort" || i + 2 >= argc)
+            return usage();
+
+        if (outputs.size() == 64)
+        {
+            std::cerr << "At most 63 cohorts are supported" << std::endl;
+            return 1;
+        }
+
+        std::ifstream users{argv[i + 1]};
+        if (!users)
+        {
+            std::cerr << "Could not open " << argv[i + 1] << std::endl;
+            return 1;
+        }
+
+        std::string username;
+        while (users >> username)
+            memberships[username] |= uint64_t{1} << outputs.size();
+        outputs.emplace_back(argv[i + 2]);
+        i += 2;
+    }
+
+    auto report = [](const sequence_stats& total) {
+        auto mean = static_cast<double>(total.actions) / total.sequences;
+        LOG(info) << "Training data consumed!" << ENDLG;
+        LOG(info) << "Users: " << total.users << ENDLG;
+        LOG(info) << "Sequences: " << total.sequences << ENDLG;
+        LOG(info) << "Sequences per user: "
+                  << static_cast<double>(total.sequences) / total.users
+                  << ENDLG;
+        LOG(info) << "Average sequence length: " << mean << ENDLG;
+        LOG(info) << "Variance of sequence length: "
+                  << (total.squared_lengths - total.sequences * mean * mean)
+                         / (total.sequences - 1)
+                  << ENDLG;
+    };
+
+    sequence_stats total;
+    if (order == 1)
+    {
+        auto counts = count_cohorts(
+            markov_model::expected_counts_type{num_actions, prior},
+            memberships, outputs.size(), total);
+        report(total);
+        write_models<markov_model>(counts, outputs);
+    }
+    else
+    {
+        auto counts = count_cohorts(
+            higher_order_markov_model::expected_counts_type{num_actions,
+                                                            order, prior},
+            memberships, outputs.size(), total);
+        report(total);
+        write_models<higher_order_markov_model>(counts, outputs);
     }
-    std::cout << arr << "\n";
 
     return 0;
 }
@@ -4,6 +4,7 @@
  */
 
 #include "json.hpp"
+#include "metrics.h"
 
 #include "meta/io/gzstream.h"
 #include "meta/sequence/hmm/hmm.h"
@@ -51,6 +52,7 @@ util::string_view action_name(sequence::state_id aid)
 int main(int argc, char** argv)
 {
     logging::set_cerr_logging();
+    metrics::session session{"print-hmm"};
 
     if (argc < 2)
     {
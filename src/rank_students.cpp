@@ -2,167 +2,452 @@
  * @file rank_students.cpp
  * Given a file of decoded sequences and an "ideal" ranking, computes the
  * rank correlation between the ranked list of students by preference for
- * a certain state and the ideal ranking.
+ * a certain state and the ideal ranking. The decoded file may be a JSON
+ * array or line-delimited JSON.
+ *
+ * Every decoded feature is evaluated: the K state probabilities and the
+ * K x K transition probabilities. The decoded output is loaded once into
+ * a columnar matrix indexed by interned student ids, and the features
+ * are ranked in parallel.
+ *
+ * Optionally, bootstrap confidence intervals over students and
+ * permutation p-values are computed for every feature.
  */
 
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <sstream>
+
 #include "json.hpp"
+#include "json_records.h"
+#include "kendall_tau.h"
+#include "metrics.h"
 
-#include "meta/classify/classifier/sgd.h"
 #include "meta/hashing/probe_map.h"
-#include "meta/index/eval/rank_correlation.h"
 #include "meta/logging/logger.h"
+#include "meta/parallel/thread_pool.h"
 #include "meta/stats/running_stats.h"
+#include "meta/util/optional.h"
+#include "meta/util/string_view.h"
 
 using namespace meta;
 using namespace nlohmann;
 
-int main(int argc, char** argv)
+/**
+ * The decoded features of every student, stored by column. Students are
+ * interned in the order they are read, and their grades are kept in a
+ * dense array indexed by the same id.
+ */
+struct feature_columns
 {
-    logging::set_cerr_logging();
+    void add_student(const json& student, double grade)
+    {
+        const auto& state_probs = student["state_probs"];
+        const auto& transitions = student["transitions"];
+        if (columns.empty())
+        {
+            num_states = state_probs.size();
+            columns.resize(num_states + num_states * num_states);
+        }
+        if (state_probs.size() != num_states)
+            throw std::runtime_error{"students decoded with differing numbers "
+                                     "of states"};
+
+        uint64_t f = 0;
+        for (const auto& prob : state_probs)
+            columns[f++].push_back(value(prob));
+        for (const auto& row : transitions)
+            for (const auto& prob : row)
+                columns[f++].push_back(value(prob));
+
+        usernames.push_back(student["username"].get<std::string>());
+        grades.push_back(grade);
+    }
 
-    if (argc != 3)
+    /**
+     * A human-readable name for a feature: "s" for a state and "i, j"
+     * for a transition.
+     */
+    std::string name(uint64_t f) const
     {
-        std::cerr << "Usage: " << argv[0] << " features.json ideal_rank.tsv"
-                  << std::endl;
+        if (f < num_states)
+            return std::to_string(f);
+        f -= num_states;
+        return std::to_string(f / num_states) + ", "
+               + std::to_string(f % num_states);
     }
 
-    json feats;
+    uint64_t num_students() const
     {
-        std::ifstream feats_file{argv[1]};
-        feats_file >> feats;
+        return usernames.size();
     }
 
-    hashing::probe_map<std::string, double> grades;
+    // students with no transitions out of a state have no posterior
+    // transition probabilities from it
+    static double value(const json& prob)
     {
-        std::ifstream grades_file{argv[2]};
-        std::string username;
-        double grade;
-        while (grades_file >> username >> grade)
-        {
-            grades[username] = grade;
-        }
+        return prob.is_null() ? 0.0 : prob.get<double>();
     }
 
-    std::vector<double> ideal(feats.size());
-    std::vector<double> candidate(feats.size());
+    uint64_t num_states = 0;
+    std::vector<std::vector<double>> columns;
+    std::vector<std::string> usernames;
+    std::vector<double> grades;
+};
 
-    for (uint64_t s = 0; s < feats[0]["state_probs"].size(); ++s)
-    {
-        uint64_t i = 0;
+/**
+ * The observed statistics of one feature, and its report.
+ */
+struct feature_result
+{
+    rank_statistics stats;
+    std::string report;
+};
+
+/**
+ * Ranks the students by one feature and reports its rank correlation
+ * with the grades, and the mean rank of the perfect (grade >= 10) and
+ * low (grade <= 7) students.
+ */
+feature_result evaluate(const feature_columns& feats, uint64_t f)
+{
+    const auto& column = feats.columns[f];
+    auto n = feats.num_students();
 
-        hashing::probe_map<std::string, double> prob;
+    // argsort by decreasing feature value, breaking ties by student id
+    std::vector<uint64_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) {
+        return column[b] < column[a];
+    });
 
-        std::vector<std::string> all_students;
-        all_students.reserve(feats.size());
-        for (const auto& j : feats)
-        {
-            auto username = j["username"].get<std::string>();
-            ideal[i] = grades[username];
-            candidate[i] = j["state_probs"][s];
+    stats::running_stats perfect;
+    stats::running_stats low;
+    for (uint64_t rank = 0; rank < n; ++rank)
+    {
+        auto grade = feats.grades[order[rank]];
+        if (grade >= 10)
+            perfect.add(rank);
+        else if (grade <= 7)
+            low.add(rank);
+    }
+
+    rank_correlator correlator;
+    auto rnk = correlator(column.data(), feats.grades.data(), n);
 
-            prob[username] = candidate[i];
+    auto name = feats.name(f);
+    std::ostringstream os;
+    os << "tau_b(" << name << "): " << rnk.tau_b << "\n";
+    os << "NDPM(" << name << "): " << rnk.ndpm << "\n";
+    os << "avg rank(" << name << ", perfect): " << perfect.mean()
+       << ", SD: " << perfect.stddev() << ", N: " << perfect.size() << "\n";
+    os << "avg rank(" << name << ", low): " << low.mean()
+       << ", SD: " << low.stddev() << ", N: " << low.size() << "\n";
+    return {rnk, os.str()};
+}
 
-            all_students.push_back(username);
+/**
+ * Splits num_resamples resamples into a fixed number of chunks and runs
+ * fn(begin, end, rng) for each chunk on the pool. Every chunk has its own
+ * random number stream, seeded from the chunk number, so the results do
+ * not depend on the number of threads.
+ */
+template <class Function>
+void for_each_chunk(uint64_t num_resamples, uint64_t seed,
+                    parallel::thread_pool& pool, Function&& fn)
+{
+    const uint64_t num_chunks = std::min<uint64_t>(num_resamples, 64);
+    std::vector<std::future<void>> chunks;
+    for (uint64_t c = 0; c < num_chunks; ++c)
+    {
+        chunks.push_back(pool.submit_task([&, c]() {
+            std::seed_seq seq{seed, c};
+            std::mt19937_64 rng{seq};
+            fn(c * num_resamples / num_chunks,
+               (c + 1) * num_resamples / num_chunks, rng);
+        }));
+    }
 
-            ++i;
-        }
+    for (auto& chunk : chunks)
+        chunk.get();
+}
 
-        std::sort(all_students.begin(), all_students.end(),
-                  [&](const std::string& u1, const std::string& u2) {
-                      return prob[u2] < prob[u1];
-                  });
+/**
+ * Bootstrap percentile confidence intervals for the tau_b and NDPM of
+ * every feature. Each resample draws students with replacement, and
+ * every feature is evaluated on the same draw.
+ */
+struct bootstrap_result
+{
+    bootstrap_result(const feature_columns& feats, uint64_t num_resamples,
+                     uint64_t seed, parallel::thread_pool& pool)
+        : num_resamples_{num_resamples},
+          tau_b_(feats.columns.size() * num_resamples),
+          ndpm_(feats.columns.size() * num_resamples)
+    {
+        auto n = feats.num_students();
+        for_each_chunk(num_resamples, seed, pool, [&](uint64_t begin,
+                                                      uint64_t end,
+                                                      std::mt19937_64& rng) {
+            // all allocation happens here, once per chunk
+            std::vector<uint64_t> idx(n);
+            std::vector<double> xs(n);
+            std::vector<double> ys(n);
+            rank_correlator correlator;
+            std::uniform_int_distribution<uint64_t> pick{0, n - 1};
 
-        stats::running_stats perfect;
-        stats::running_stats low;
-        i = 0;
-        for (const auto& user : all_students)
-        {
-            if (grades[user] >= 10)
-            {
-                perfect.add(i);
-            }
-            else if (grades[user] <= 7)
+            for (auto b = begin; b < end; ++b)
             {
-                low.add(i);
+                for (uint64_t k = 0; k < n; ++k)
+                {
+                    idx[k] = pick(rng);
+                    ys[k] = feats.grades[idx[k]];
+                }
+
+                for (uint64_t f = 0; f < feats.columns.size(); ++f)
+                {
+                    const auto& column = feats.columns[f];
+                    for (uint64_t k = 0; k < n; ++k)
+                        xs[k] = column[idx[k]];
+                    auto stats = correlator(xs.data(), ys.data(), n);
+                    tau_b_[f * num_resamples_ + b] = stats.tau_b;
+                    ndpm_[f * num_resamples_ + b] = stats.ndpm;
+                }
             }
+        });
+    }
 
-            i++;
-        }
+    std::pair<double, double> tau_b(uint64_t f, double confidence) const
+    {
+        return interval(tau_b_, f, confidence);
+    }
 
-        index::rank_correlation rnk{candidate, ideal};
-        std::cout << "tau_b(" << s << "): " << rnk.tau_b() << "\n";
-        std::cout << "NDPM(" << s << "): " << rnk.ndpm() << "\n";
-        std::cout << "avg rank(" << s << ", perfect): " << perfect.mean()
-                  << ", SD: " << perfect.stddev() << ", N: " << perfect.size()
-                  << "\n";
-        std::cout << "avg rank(" << s << ", low): " << low.mean()
-                  << ", SD: " << low.stddev() << ", N: " << low.size()
-                  << "\n\n";
+    std::pair<double, double> ndpm(uint64_t f, double confidence) const
+    {
+        return interval(ndpm_, f, confidence);
     }
 
-    uint64_t i = 0;
-    hashing::probe_map<std::string, double> prob;
-    std::vector<std::string> all_students;
-    all_students.reserve(feats.size());
-    for (const auto& j : feats)
+  private:
+    /**
+     * The percentile interval of one feature's resampled statistic,
+     * ignoring resamples where it is undefined.
+     */
+    std::pair<double, double> interval(const std::vector<double>& values,
+                                       uint64_t f, double confidence) const
     {
-        auto username = j["username"].get<std::string>();
-        ideal[i] = grades[username];
+        std::vector<double> sorted;
+        auto begin = values.begin() + f * num_resamples_;
+        std::copy_if(begin, begin + num_resamples_, std::back_inserter(sorted),
+                     [](double val) { return !std::isnan(val); });
+        if (sorted.empty())
+            return {std::nan(""), std::nan("")};
+        std::sort(sorted.begin(), sorted.end());
 
-        if (j["transitions"][2][2].is_null())
+        auto quantile = [&](double q) {
+            auto pos = static_cast<uint64_t>(q * (sorted.size() - 1) + 0.5);
+            return sorted[pos];
+        };
+        auto tail = (1 - confidence) / 2;
+        return {quantile(tail), quantile(1 - tail)};
+    }
+
+    uint64_t num_resamples_;
+    std::vector<double> tau_b_;
+    std::vector<double> ndpm_;
+};
+
+/**
+ * Two-sided permutation p-values for the tau_b of every feature: the
+ * fraction of random permutations of the grades under which |tau_b| is
+ * at least as large as observed.
+ */
+std::vector<double>
+permutation_test(const feature_columns& feats,
+                 const std::vector<feature_result>& observed,
+                 uint64_t num_permutations, uint64_t seed,
+                 parallel::thread_pool& pool)
+{
+    auto n = feats.num_students();
+    auto num_features = feats.columns.size();
+
+    std::mutex mutex;
+    std::vector<uint64_t> exceeded(num_features);
+    for_each_chunk(num_permutations, seed, pool, [&](uint64_t begin,
+                                                     uint64_t end,
+                                                     std::mt19937_64& rng) {
+        std::vector<double> ys(feats.grades);
+        std::vector<uint64_t> chunk_exceeded(num_features);
+        rank_correlator correlator;
+
+        for (auto p = begin; p < end; ++p)
         {
-            candidate[i] = 0;
+            std::shuffle(ys.begin(), ys.end(), rng);
+            for (uint64_t f = 0; f < num_features; ++f)
+            {
+                auto stats
+                    = correlator(feats.columns[f].data(), ys.data(), n);
+                if (std::abs(stats.tau_b)
+                    >= std::abs(observed[f].stats.tau_b))
+                    ++chunk_exceeded[f];
+            }
         }
+
+        std::lock_guard<std::mutex> lock{mutex};
+        for (uint64_t f = 0; f < num_features; ++f)
+            exceeded[f] += chunk_exceeded[f];
+    });
+
+    // tau_b is undefined (and so is its p-value) for constant features
+    std::vector<double> p_values(num_features);
+    for (uint64_t f = 0; f < num_features; ++f)
+        p_values[f] = std::isnan(observed[f].stats.tau_b)
+                          ? std::nan("")
+                          : (exceeded[f] + 1.0) / (num_permutations + 1.0);
+    return p_values;
+}
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"rank-students"};
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " features.json ideal_rank.tsv [--bootstrap B]"
+                     " [--permutations P] [--confidence c] [--seed s]"
+                     " [--model file|index]"
+                  << std::endl;
+        return 1;
+    };
+
+    if (argc < 3)
+        return usage();
+
+    uint64_t num_bootstrap = 0;
+    uint64_t num_permutations = 0;
+    double confidence = 0.95;
+    uint64_t seed = 47;
+    // which model's posteriors to use when decode was given several
+    std::string model;
+    for (int i = 3; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (i + 1 == argc)
+            return usage();
+
+        if (flag == "--bootstrap")
+            num_bootstrap = std::stoull(argv[++i]);
+        else if (flag == "--permutations")
+            num_permutations = std::stoull(argv[++i]);
+        else if (flag == "--confidence")
+            confidence = std::stod(argv[++i]);
+        else if (flag == "--seed")
+            seed = std::stoull(argv[++i]);
+        else if (flag == "--model")
+            model = argv[++i];
         else
+            return usage();
+    }
+
+    if (confidence <= 0 || confidence >= 1)
+    {
+        std::cerr << "Confidence level must be in (0, 1)" << std::endl;
+        return 1;
+    }
+
+    hashing::probe_map<std::string, double> grades;
+    {
+        std::ifstream grades_file{argv[2]};
+        std::string username;
+        double grade;
+        while (grades_file >> username >> grade)
         {
-            candidate[i] = j["transitions"][2][2];
+            grades[username] = grade;
         }
+    }
 
-        prob[username] = candidate[i];
+    feature_columns feats;
+    {
+        metrics::stage_timer timer{"read"};
+        std::ifstream feats_file{argv[1]};
+        for_each_json_record(feats_file, [&](const json& record) {
+            auto student = select_model(record, model);
+            auto it = grades.find(student["username"].get<std::string>());
+            feats.add_student(student,
+                              it == grades.end() ? 0.0 : it->value());
+        });
+    }
 
-        all_students.push_back(username);
+    LOG(info) << "Ranking " << feats.num_students() << " students by "
+              << feats.columns.size() << " features..." << ENDLG;
 
-        ++i;
+    if (feats.num_students() == 0)
+    {
+        std::cerr << "No decoded students found" << std::endl;
+        return 1;
     }
 
-    std::sort(all_students.begin(), all_students.end(),
-              [&](const std::string& u1, const std::string& u2) {
-                  return prob[u2] < prob[u1];
-              });
+    metrics::get_counter("students") += feats.num_students();
 
-    stats::running_stats perfect;
-    stats::running_stats low;
-    i = 0;
-    for (const auto& user : all_students)
+    parallel::thread_pool pool;
+    metrics::track_threads(pool);
+    metrics::stage_timer evaluate_timer{"evaluate"};
+    std::vector<std::future<feature_result>> futures;
+    for (uint64_t f = 0; f < feats.columns.size(); ++f)
+        futures.push_back(
+            pool.submit_task([&feats, f]() { return evaluate(feats, f); }));
+
+    std::vector<feature_result> results;
+    for (auto& result : futures)
+        results.push_back(result.get());
+    evaluate_timer.stop();
+
+    util::optional<bootstrap_result> bootstrap;
+    if (num_bootstrap > 0)
     {
-        if (grades[user] >= 10)
-        {
-            perfect.add(i);
-        }
-        else if (grades[user] <= 7)
+        LOG(info) << "Running " << num_bootstrap << " bootstrap resamples..."
+                  << ENDLG;
+        metrics::stage_timer timer{"bootstrap"};
+        bootstrap = bootstrap_result{feats, num_bootstrap, seed, pool};
+    }
+
+    std::vector<double> p_values;
+    if (num_permutations > 0)
+    {
+        LOG(info) << "Running " << num_permutations << " permutations..."
+                  << ENDLG;
+        metrics::stage_timer timer{"permutations"};
+        p_values = permutation_test(feats, results, num_permutations,
+                                    seed + 1, pool);
+    }
+
+    for (uint64_t f = 0; f < results.size(); ++f)
+    {
+        std::cout << results[f].report;
+
+        auto name = feats.name(f);
+        if (bootstrap)
         {
-            low.add(i);
+            auto tau_b = bootstrap->tau_b(f, confidence);
+            auto ndpm = bootstrap->ndpm(f, confidence);
+            std::cout << "tau_b(" << name << ") " << confidence * 100
+                      << "% CI: [" << tau_b.first << ", " << tau_b.second
+                      << "]\n";
+            std::cout << "NDPM(" << name << ") " << confidence * 100
+                      << "% CI: [" << ndpm.first << ", " << ndpm.second
+                      << "]\n";
         }
-
-        ++i;
-    }
-
-    index::rank_correlation rnk{candidate, ideal};
-    std::cout << "tau_b("
-              << "2, 2"
-              << "): " << rnk.tau_b() << "\n";
-    std::cout << "NDPM("
-              << "2, 2"
-              << "): " << rnk.ndpm() << "\n";
-    std::cout << "avg rank("
-              << "2, 2"
-              << ", perfect): " << perfect.mean()
-              << ", SD: " << perfect.stddev() << ", N: " << perfect.size()
-              << "\n";
-    std::cout << "avg rank("
-              << "2, 2"
-              << ", low): " << low.mean() << ", SD: " << low.stddev()
-              << ", N: " << low.size() << "\n\n";
+        if (!p_values.empty())
+            std::cout << "tau_b(" << name << ") permutation p: "
+                      << p_values[f] << "\n";
+        std::cout << "\n";
+    }
 
     return 0;
 }
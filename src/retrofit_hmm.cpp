@@ -7,7 +7,9 @@
 #include <array>
 #include <exception>
 
+#include "distributed_em.h"
 #include "json.hpp"
+#include "metrics.h"
 #include "retrofit_hmm.h"
 
 #include "meta/io/gzstream.h"
@@ -15,6 +17,7 @@
 #include "meta/sequence/hmm/sequence_observations.h"
 #include "meta/stats/running_stats.h"
 #include "meta/util/identifiers.h"
+#include "meta/util/optional.h"
 
 using namespace nlohmann;
 using namespace meta;
@@ -40,14 +43,132 @@ util::string_view action_name(sequence::state_id aid)
 int main(int argc, char** argv)
 {
     logging::set_cerr_logging();
+    metrics::session session{"retrofit-hmm"};
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " input output [--checkpoint file]"
+                     " [--checkpoint-interval N] [--resume file]"
+                     " [--coordinator address --workers N]"
+                     " [--worker address --rank r] [--accelerate]"
+                     " [--single-precision]"
+                  << std::endl;
+        return 1;
+    };
+
+    if (argc < 3)
+        return usage();
+
+    using namespace sequence;
+    using namespace hmm;
+    using hmm_type = hidden_markov_model<sequence_observations>;
+
+    hmm_type::training_options options;
+    options.delta = 1e-4;
+    options.max_iters = 50;
+    options.frozen.observations = true;
+    std::string resume_file;
+    std::string coordinator_address;
+    std::string worker_address;
+    util::optional<uint64_t> worker_rank;
+    uint64_t num_workers = 0;
+
+    for (int i = 3; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (flag == "--accelerate")
+        {
+            options.accelerate = true;
+            continue;
+        }
+
+        if (flag == "--single-precision")
+        {
+            options.single_precision = true;
+            continue;
+        }
+
+        if (i + 1 == argc)
+            return usage();
+
+        if (flag == "--checkpoint")
+            options.checkpoint_file = argv[++i];
+        else if (flag == "--checkpoint-interval")
+            options.checkpoint_interval = std::stoull(argv[++i]);
+        else if (flag == "--resume")
+            resume_file = argv[++i];
+        else if (flag == "--coordinator")
+            coordinator_address = argv[++i];
+        else if (flag == "--workers")
+            num_workers = std::stoull(argv[++i]);
+        else if (flag == "--worker")
+            worker_address = argv[++i];
+        else if (flag == "--rank")
+            worker_rank = std::stoull(argv[++i]);
+        else
+            return usage();
+    }
 
-    if (argc != 3)
+    if (options.checkpoint_interval == 0)
     {
-        std::cerr << "Usage: " << argv[0] << " input output" << std::endl;
+        std::cerr << "Checkpoint interval must be positive" << std::endl;
         return 1;
     }
 
-    using namespace sequence;
+    if (options.accelerate
+        && (!coordinator_address.empty() || !worker_address.empty()))
+    {
+        std::cerr << "Distributed retrofitting cannot be accelerated"
+                  << std::endl;
+        return 1;
+    }
+
+    if (!coordinator_address.empty() && num_workers == 0)
+    {
+        std::cerr << "The coordinator needs a positive number of workers"
+                  << std::endl;
+        return 1;
+    }
+
+    if (!worker_address.empty() && !worker_rank)
+    {
+        std::cerr << "Each worker needs its rank among the workers"
+                  << std::endl;
+        return 1;
+    }
+
+    hmm_type::training_state state;
+    state.rng.seed(47);
+
+    // when resuming, the checkpoint replaces the input model; workers get
+    // the model from the coordinator instead, so they never load it
+    auto load_model = [&]() {
+        io::gzifstream input{resume_file.empty() ? argv[1] : resume_file};
+        hmm_type hmm{input};
+        if (!resume_file.empty())
+        {
+            state.load(input);
+            LOG(info) << "Resuming retrofitting after iteration "
+                      << state.iteration << "..." << ENDLG;
+        }
+        return hmm;
+    };
+
+    if (!coordinator_address.empty())
+    {
+        auto hmm = load_model();
+
+        // the coordinator holds no training data: the workers own it
+        LOG(info) << "Beginning distributed retrofitting..." << ENDLG;
+        run_em_coordinator(hmm, coordinator_address, num_workers, options,
+                           state);
+
+        LOG(info) << "Saving modified model..." << ENDLG;
+        io::gzofstream output{argv[2]};
+        hmm.save(output);
+        return 0;
+    }
+
     using action_sequence_type = std::vector<state_id>;
     using sequence_type = std::vector<action_sequence_type>;
     using training_data_type = std::vector<sequence_type>;
@@ -55,11 +176,14 @@ int main(int argc, char** argv)
     std::vector<std::string> usernames;
     training_data_type train;
 
+    metrics::stage_timer read_timer{"read"};
+    auto& byte_count = metrics::get_counter("bytes");
     stats::running_stats stats;
     std::string line;
     uint64_t total_sequences = 0;
     while (std::getline(std::cin, line))
     {
+        byte_count += line.size() + 1;
         auto obj = json::parse(line);
         usernames.push_back(obj["username"].get<std::string>());
 
@@ -71,6 +195,9 @@ int main(int argc, char** argv)
 
         total_sequences += sequences.size();
     }
+    read_timer.stop();
+    metrics::get_counter("users") += usernames.size();
+    metrics::get_counter("sequences") += total_sequences;
 
     LOG(info) << "Training data consumed!" << ENDLG;
     LOG(info) << "Users: " << usernames.size() << ENDLG;
@@ -81,20 +208,18 @@ int main(int argc, char** argv)
     LOG(info) << "Average sequence length: " << stats.mean() << ENDLG;
     LOG(info) << "Variance of sequence length: " << stats.variance() << ENDLG;
 
-    std::mt19937 rng{47};
-
-    using namespace hmm;
-
     parallel::thread_pool pool;
-    io::gzifstream input{argv[1]};
-    hidden_markov_model<sequence_observations> hmm{input};
+    metrics::track_threads(pool);
 
-    decltype(hmm)::training_options options;
-    options.delta = 1e-4;
-    options.max_iters = 50;
+    if (!worker_address.empty())
+    {
+        run_em_worker<hmm_type>(train, worker_address, *worker_rank, pool);
+        return 0;
+    }
 
+    auto hmm = load_model();
     LOG(info) << "Beginning retrofitting..." << ENDLG;
-    hmm.fit(train, pool, options);
+    hmm.fit(train, pool, options, state);
 
     LOG(info) << "Saving modified model..." << ENDLG;
     io::gzofstream output{argv[2]};
@@ -0,0 +1,760 @@
+/**
+ * @file run_pipeline.cpp
+ * Runs the sort, extract, train, and decode stages for many course
+ * directories at once, as a dependency graph scheduled under a global
+ * memory and core budget.
+ *
+ * Each stage declares the files it reads and writes (relative to the
+ * course directory), its peak memory, and the number of cores it uses. A
+ * stage depends on the stages that write its inputs. A stage is skipped
+ * when its outputs are all newer than its inputs and nothing upstream of
+ * it ran, as with make. Stages whose inputs are missing (e.g. the
+ * respondent lists for a course without survey data) are skipped along
+ * with everything that depends on them.
+ *
+ * Any number of stages from any courses run concurrently, as long as
+ * their declared memory fits in the budget and their cores are free. Each
+ * running stage is pinned to its own cores, and its output goes to
+ * logs/<stage>.log in the course directory.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "json.hpp"
+#include "metrics.h"
+
+#include "meta/logging/logger.h"
+#include "meta/util/optional.h"
+#include "meta/util/string_view.h"
+
+using namespace nlohmann;
+using namespace meta;
+
+/**
+ * One step of the per-course pipeline. Paths are relative to the course
+ * directory; the command runs there under bash with pipefail, after
+ * {build}, {states}, and {clickstream} are substituted.
+ */
+struct stage_spec
+{
+    std::string name;
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+    std::string command;
+    /// declared peak memory, in GB
+    double memory;
+    uint64_t cores;
+};
+
+/**
+ * The stages run by make_sorted_clickstream.sh, extract_respondents.sh,
+ * run_plain_mm.sh, and run_two_layer.sh, in dependency order.
+ */
+std::vector<stage_spec> default_stages()
+{
+    const std::string sorted = "clickstream_with_post_and_quiz.json.sorted.gz";
+    const std::string all = "sequences_10h_all.json";
+    const std::string se_asia = "sequences_10h_se_asia.json";
+    const std::string hmm = "results/two-layer/hmm-model.gz";
+    const std::string se_asia_hmm = "results/two-layer/hmm-model_se_asia.gz";
+
+    return {
+        // merge-sorted keeps the lines it sorts under --memory; the rest
+        // is headroom for the reorder windows
+        {"sort",
+         {"{clickstream}", "post-times.json.gz", "quiz-times.json.gz"},
+         {sorted},
+         "{build}/merge-sorted --dedup --memory 3 {clickstream} "
+         "post-times.json.gz quiz-times.json.gz | pigz -p 1 > "
+             + sorted,
+         4, 2},
+        {"extract",
+         {sorted},
+         {all},
+         "zcat " + sorted + " | {build}/extract-sequences > " + all,
+         16, 2},
+        // grep exits with 1 when nothing matches, which is not an error
+        {"filter",
+         {all, "all_respondents.txt", "se_asia_respondents.txt"},
+         {"sequences_10h_respondents.json", se_asia},
+         "{ grep -F -f all_respondents.txt " + all
+             + " > sequences_10h_respondents.json || [ $? -eq 1 ]; } && "
+               "{ grep -F -f se_asia_respondents.txt "
+             + all + " > " + se_asia + " || [ $? -eq 1 ]; }",
+         1, 1},
+        {"plain-mm",
+         {all, "all_respondents.txt", "se_asia_respondents.txt"},
+         {"results/plain_mm_all.json", "results/plain_mm_respondents.json",
+          "results/plain_mm_se_asia.json"},
+         "mkdir -p results && {build}/plain-mm "
+         "--cohort all_respondents.txt results/plain_mm_respondents.json "
+         "--cohort se_asia_respondents.txt results/plain_mm_se_asia.json "
+         "< "
+             + all + " > results/plain_mm_all.json",
+         4, 1},
+        {"train",
+         {all},
+         {hmm},
+         "mkdir -p results/two-layer && cd results/two-layer && "
+         "{build}/clickstream-hmm {states} < ../../"
+             + all,
+         16, 8},
+        {"retrofit",
+         {hmm, se_asia},
+         {se_asia_hmm},
+         "cd results/two-layer && {build}/retrofit-hmm hmm-model.gz "
+         "hmm-model_se_asia.gz < ../../"
+             + se_asia,
+         8, 8},
+        {"print",
+         {hmm, se_asia_hmm},
+         {"results/two-layer/states.json", "results/two-layer/all_trans.json",
+          "results/two-layer/se_asia_trans.json"},
+         "cd results/two-layer && "
+         "{build}/print-hmm json hmm-model.gz > states.json && "
+         "{build}/print-hmm json-trans hmm-model.gz > all_trans.json && "
+         "{build}/print-hmm json-trans hmm-model_se_asia.gz "
+         "> se_asia_trans.json",
+         1, 1},
+        {"decode",
+         {hmm, se_asia_hmm, se_asia},
+         {"results/two-layer/se_asia_decoded.json"},
+         "cd results/two-layer && {build}/decode hmm-model.gz "
+         "hmm-model_se_asia.gz < ../../"
+             + se_asia + " > se_asia_decoded.json",
+         8, 8}};
+}
+
+/**
+ * Replaces every occurrence of a placeholder.
+ */
+std::string substitute(std::string str, const std::string& placeholder,
+                       const std::string& value)
+{
+    for (auto pos = str.find(placeholder); pos != std::string::npos;
+         pos = str.find(placeholder, pos + value.size()))
+    {
+        str.replace(pos, placeholder.size(), value);
+    }
+    return str;
+}
+
+/**
+ * @return the modification time of a file in nanoseconds, or nothing if
+ * it does not exist
+ */
+util::optional<int64_t> modified_time(const std::string& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return util::nullopt;
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000
+           + st.st_mtim.tv_nsec;
+}
+
+enum class job_state
+{
+    waiting,
+    ready,
+    running,
+    ran,
+    up_to_date,
+    missing_inputs,
+    failed,
+    blocked
+};
+
+/**
+ * One stage of one course.
+ */
+struct job
+{
+    std::string course;
+    std::string stage;
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+    std::string command;
+    double memory;
+    uint64_t cores;
+
+    std::vector<uint64_t> dependencies;
+    std::vector<uint64_t> dependents;
+    uint64_t unfinished = 0;
+    /// inputs written by a dependency, which a dry run cannot expect to
+    /// exist
+    std::vector<bool> generated;
+
+    job_state state = job_state::waiting;
+    pid_t pid = -1;
+    std::vector<int> cpus;
+    std::chrono::steady_clock::time_point start;
+
+    std::string name() const
+    {
+        return course + ": " + stage;
+    }
+
+    std::string path(const std::string& file) const
+    {
+        return course + "/" + file;
+    }
+};
+
+/**
+ * Runs the jobs of every course, starting each one once its dependencies
+ * have finished and its declared memory and cores are free.
+ */
+class scheduler
+{
+  public:
+    scheduler(std::vector<job> jobs, double memory, std::vector<int> cpus,
+              bool dry_run)
+        : jobs_(std::move(jobs)),
+          memory_{memory},
+          free_cpus_{std::move(cpus)},
+          total_cores_{free_cpus_.size()},
+          dry_run_{dry_run}
+    {
+        for (uint64_t j = 0; j < jobs_.size(); ++j)
+        {
+            if (jobs_[j].unfinished == 0)
+                resolve(j);
+        }
+    }
+
+    /**
+     * Runs until every job has finished or been skipped.
+     * @return whether no job failed
+     */
+    bool run()
+    {
+        static auto& failed_count = metrics::get_counter("jobs_failed");
+
+        while (true)
+        {
+            start_ready();
+            if (running_ == 0)
+                break;
+
+            int status;
+            auto pid = waitpid(-1, &status, 0);
+            if (pid < 0)
+                throw std::runtime_error{"waitpid failed"};
+
+            auto it = std::find_if(
+                jobs_.begin(), jobs_.end(),
+                [&](const job& jb) { return jb.pid == pid; });
+            if (it == jobs_.end())
+                continue;
+
+            auto& jb = *it;
+            std::chrono::duration<double> elapsed
+                = std::chrono::steady_clock::now() - jb.start;
+            release(jb);
+
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            {
+                LOG(info) << jb.name() << " finished in " << elapsed.count()
+                          << "s" << ENDLG;
+                check_memory(jb);
+                finish(static_cast<uint64_t>(it - jobs_.begin()),
+                       job_state::ran);
+            }
+            else
+            {
+                ++failed_count;
+                LOG(error) << jb.name() << " failed after " << elapsed.count()
+                           << "s; see " << jb.path("logs/" + jb.stage + ".log")
+                           << ENDLG;
+                // like make's .DELETE_ON_ERROR, so a partial output is not
+                // mistaken for an up-to-date one next time
+                for (const auto& output : jb.outputs)
+                    std::remove(jb.path(output).c_str());
+                finish(static_cast<uint64_t>(it - jobs_.begin()),
+                       job_state::failed);
+            }
+        }
+
+        std::map<job_state, uint64_t> counts;
+        for (const auto& jb : jobs_)
+            ++counts[jb.state];
+        LOG(info) << "Ran " << counts[job_state::ran] << ", up to date "
+                  << counts[job_state::up_to_date] << ", missing inputs "
+                  << counts[job_state::missing_inputs] << ", failed "
+                  << counts[job_state::failed] << ", blocked "
+                  << counts[job_state::blocked] << ENDLG;
+        return counts[job_state::failed] == 0;
+    }
+
+  private:
+    /**
+     * Decides what to do with a job whose dependencies have all finished,
+     * and passes the decision on to its dependents.
+     */
+    void resolve(uint64_t j)
+    {
+        static auto& skipped_count = metrics::get_counter("jobs_skipped");
+
+        auto& jb = jobs_[j];
+        bool upstream_ran = false;
+        for (const auto& dep : jb.dependencies)
+        {
+            auto state = jobs_[dep].state;
+            if (state == job_state::failed || state == job_state::blocked
+                || state == job_state::missing_inputs)
+            {
+                LOG(warning) << jb.name() << " skipped: " << jobs_[dep].stage
+                             << " did not complete" << ENDLG;
+                finish(j, job_state::blocked);
+                return;
+            }
+            upstream_ran = upstream_ran || state == job_state::ran;
+        }
+
+        auto newest_input = std::numeric_limits<int64_t>::min();
+        std::vector<std::string> missing;
+        for (uint64_t i = 0; i < jb.inputs.size(); ++i)
+        {
+            auto time = modified_time(jb.path(jb.inputs[i]));
+            if (time)
+                newest_input = std::max(newest_input, *time);
+            else if (!dry_run_ || !jb.generated[i])
+                missing.push_back(jb.inputs[i]);
+        }
+
+        auto oldest_output = std::numeric_limits<int64_t>::max();
+        bool outputs_exist = true;
+        for (const auto& output : jb.outputs)
+        {
+            auto time = modified_time(jb.path(output));
+            if (!time)
+            {
+                outputs_exist = false;
+                break;
+            }
+            oldest_output = std::min(oldest_output, *time);
+        }
+
+        // an output with missing inputs is treated as a source file, so a
+        // course can start from its sorted dump
+        if (!upstream_ran && outputs_exist && newest_input <= oldest_output)
+        {
+            ++skipped_count;
+            finish(j, job_state::up_to_date);
+            return;
+        }
+
+        if (!missing.empty())
+        {
+            LOG(warning) << jb.name() << " skipped: missing " << missing[0]
+                         << ENDLG;
+            finish(j, job_state::missing_inputs);
+            return;
+        }
+
+        jb.state = job_state::ready;
+    }
+
+    /**
+     * Records a finished job and resolves the dependents it was the last
+     * dependency of.
+     */
+    void finish(uint64_t j, job_state state)
+    {
+        jobs_[j].state = state;
+        for (const auto& dep : jobs_[j].dependents)
+        {
+            if (--jobs_[dep].unfinished == 0)
+                resolve(dep);
+        }
+    }
+
+    /**
+     * Starts every ready job that fits in the free memory and cores, in
+     * course order. A job larger than the whole budget runs once nothing
+     * else is running. Dependents always come after their dependencies,
+     * so one pass sees every job a dry run makes ready.
+     */
+    void start_ready()
+    {
+        static auto& run_count = metrics::get_counter("jobs_run");
+
+        for (uint64_t j = 0; j < jobs_.size(); ++j)
+        {
+            auto& jb = jobs_[j];
+            if (jb.state != job_state::ready)
+                continue;
+
+            if (dry_run_)
+            {
+                LOG(info) << jb.name() << " would run: " << jb.command
+                          << ENDLG;
+                finish(j, job_state::ran);
+                continue;
+            }
+
+            auto cores = std::min(jb.cores, total_cores_);
+            bool fits = used_memory_ + jb.memory <= memory_
+                        && cores <= free_cpus_.size();
+            if (!fits && running_ > 0)
+                continue;
+            if (!fits)
+            {
+                LOG(warning) << jb.name() << " declares more than the budget; "
+                                         "running it alone"
+                             << ENDLG;
+            }
+
+            ++run_count;
+            start(jb, cores);
+        }
+    }
+
+    void start(job& jb, uint64_t cores)
+    {
+        jb.cpus.assign(free_cpus_.end() - cores, free_cpus_.end());
+        free_cpus_.resize(free_cpus_.size() - cores);
+        used_memory_ += jb.memory;
+        ++running_;
+
+        LOG(info) << jb.name() << " started (" << jb.memory << " GB, "
+                  << cores << " cores; " << used_memory_ << "/" << memory_
+                  << " GB in use)" << ENDLG;
+
+        auto log_dir = jb.path("logs");
+        mkdir(log_dir.c_str(), 0755);
+        // everything the child needs is built here: after fork() in a
+        // process with other threads (e.g. the metrics dumper), the child
+        // may only make async-signal-safe calls, so it cannot allocate
+        child_args args{jb};
+        jb.start = std::chrono::steady_clock::now();
+        jb.pid = fork();
+        if (jb.pid < 0)
+            throw std::runtime_error{"fork failed"};
+        if (jb.pid == 0)
+            exec(jb, args);
+        jb.state = job_state::running;
+    }
+
+    /**
+     * The arguments of a job's child process, prepared before the fork.
+     */
+    struct child_args
+    {
+        child_args(const job& jb)
+            : log_file{jb.path("logs/" + jb.stage + ".log")},
+              log_error{"Cannot open " + log_file + "\n"},
+              chdir_error{"Cannot enter " + jb.course + "\n"},
+              exec_error{"Cannot run /bin/bash\n"}
+        {
+            CPU_ZERO(&cpus);
+            for (const auto& cpu : jb.cpus)
+                CPU_SET(cpu, &cpus);
+
+            // the parent's environment, with the metrics going to the
+            // job's log directory
+            const std::string metrics_var = "CLICKSTREAM_METRICS=";
+            for (auto var = environ; *var; ++var)
+            {
+                if (util::string_view{*var}.substr(0, metrics_var.size())
+                    != metrics_var)
+                    env.emplace_back(*var);
+            }
+            env.push_back(metrics_var + "logs/" + jb.stage
+                          + ".metrics.json");
+            for (auto& var : env)
+                envp.push_back(&var[0]);
+            envp.push_back(nullptr);
+        }
+
+        std::string log_file;
+        std::string log_error;
+        std::string chdir_error;
+        std::string exec_error;
+        cpu_set_t cpus;
+        std::vector<std::string> env;
+        std::vector<char*> envp;
+    };
+
+    /**
+     * Writes a message to stderr from the child process.
+     */
+    static void child_error(const std::string& msg)
+    {
+        auto written = write(STDERR_FILENO, msg.data(), msg.size());
+        (void)written;
+    }
+
+    /**
+     * Runs the job's command in the child process. Only async-signal-safe
+     * calls may be made here.
+     */
+    [[noreturn]] void exec(const job& jb, const child_args& args)
+    {
+        auto fd = open(args.log_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                       0644);
+        if (fd < 0)
+        {
+            child_error(args.log_error);
+            _exit(127);
+        }
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+
+        sched_setaffinity(0, sizeof(args.cpus), &args.cpus);
+
+        if (chdir(jb.course.c_str()) != 0)
+        {
+            child_error(args.chdir_error);
+            _exit(127);
+        }
+        execle("/bin/bash", "bash", "-o", "pipefail", "-c",
+               jb.command.c_str(), static_cast<char*>(nullptr),
+               args.envp.data());
+        child_error(args.exec_error);
+        _exit(127);
+    }
+
+    void release(job& jb)
+    {
+        free_cpus_.insert(free_cpus_.end(), jb.cpus.begin(), jb.cpus.end());
+        jb.cpus.clear();
+        used_memory_ -= jb.memory;
+        --running_;
+        jb.pid = -1;
+    }
+
+    /**
+     * Warns when a job's last executable used more memory than the job
+     * declared, so the declarations can be corrected.
+     */
+    void check_memory(const job& jb)
+    {
+        std::ifstream input{jb.path("logs/" + jb.stage + ".metrics.json")};
+        if (!input)
+            return;
+
+        try
+        {
+            json report;
+            input >> report;
+            auto peak = report["peak_rss_kb"].get<uint64_t>() / 1048576.0;
+            if (peak > jb.memory)
+            {
+                LOG(warning) << jb.name() << " peaked at " << peak
+                             << " GB but declares " << jb.memory
+                             << " GB; raise it with --memory " << jb.stage
+                             << ENDLG;
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            LOG(warning) << jb.name() << ": unreadable metrics: " << ex.what()
+                         << ENDLG;
+        }
+    }
+
+    std::vector<job> jobs_;
+    double memory_;
+    double used_memory_ = 0;
+    std::vector<int> free_cpus_;
+    uint64_t total_cores_;
+    uint64_t running_ = 0;
+    bool dry_run_;
+};
+
+/**
+ * Instantiates every stage for every course and links each stage to the
+ * stages of the same course that write its inputs.
+ */
+std::vector<job> make_jobs(const std::vector<std::string>& courses,
+                           const std::vector<stage_spec>& stages,
+                           const std::map<std::string, std::string>& values)
+{
+    auto fill = [&](std::string str) {
+        for (const auto& pr : values)
+            str = substitute(std::move(str), "{" + pr.first + "}", pr.second);
+        return str;
+    };
+
+    std::vector<job> jobs;
+    for (const auto& course : courses)
+    {
+        std::map<std::string, uint64_t> writers;
+        for (const auto& spec : stages)
+        {
+            job jb;
+            jb.course = course;
+            jb.stage = spec.name;
+            jb.command = fill(spec.command);
+            jb.memory = spec.memory;
+            jb.cores = std::max<uint64_t>(spec.cores, 1);
+
+            auto j = jobs.size();
+            for (const auto& input : spec.inputs)
+            {
+                jb.inputs.push_back(fill(input));
+                auto it = writers.find(jb.inputs.back());
+                jb.generated.push_back(it != writers.end());
+                if (it == writers.end())
+                    continue;
+                if (std::find(jb.dependencies.begin(), jb.dependencies.end(),
+                              it->second)
+                    == jb.dependencies.end())
+                {
+                    jb.dependencies.push_back(it->second);
+                    jobs[it->second].dependents.push_back(j);
+                }
+            }
+            jb.unfinished = jb.dependencies.size();
+
+            for (const auto& output : spec.outputs)
+            {
+                jb.outputs.push_back(fill(output));
+                writers[jb.outputs.back()] = j;
+            }
+            jobs.push_back(std::move(jb));
+        }
+    }
+    return jobs;
+}
+
+/**
+ * @return the directory containing this executable
+ */
+std::string executable_dir()
+{
+    std::vector<char> buf(4096);
+    auto len = readlink("/proc/self/exe", buf.data(), buf.size() - 1);
+    if (len <= 0)
+        return ".";
+    std::string path{buf.data(), static_cast<std::size_t>(len)};
+    return path.substr(0, path.rfind('/'));
+}
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging();
+    metrics::session session{"run-pipeline"};
+
+    auto stages = default_stages();
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--memory-budget GB] [--cores N] [--build-dir dir]"
+                     " [--states K] [--clickstream file.gz]"
+                     " [--memory stage GB]... [--cores-for stage N]..."
+                     " [--dry-run] course-dir..."
+                  << std::endl
+                  << "Stages:";
+        for (const auto& spec : stages)
+            std::cerr << " " << spec.name << " (" << spec.memory << " GB, "
+                      << spec.cores << " cores)";
+        std::cerr << std::endl;
+        return 1;
+    };
+
+    auto find_stage = [&](util::string_view name) {
+        auto it = std::find_if(
+            stages.begin(), stages.end(),
+            [&](const stage_spec& spec) { return spec.name == name; });
+        if (it == stages.end())
+            throw std::invalid_argument{"unknown stage " + name.to_string()};
+        return it;
+    };
+
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    sched_getaffinity(0, sizeof(affinity), &affinity);
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &affinity))
+            cpus.push_back(cpu);
+    }
+
+    double memory = sysconf(_SC_PHYS_PAGES)
+                    * static_cast<double>(sysconf(_SC_PAGESIZE))
+                    / (1024.0 * 1024 * 1024) * 0.9;
+    uint64_t cores = cpus.size();
+    std::map<std::string, std::string> values{
+        {"build", executable_dir()},
+        {"states", "4"},
+        {"clickstream", "clickstream.json.gz"}};
+    bool dry_run = false;
+    std::vector<std::string> courses;
+    for (int i = 1; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (flag == "--dry-run")
+        {
+            dry_run = true;
+            continue;
+        }
+
+        if (flag.size() < 2 || flag.substr(0, 2) != "--")
+        {
+            courses.emplace_back(argv[i]);
+            continue;
+        }
+
+        if (i + 1 == argc)
+            return usage();
+
+        if (flag == "--memory-budget")
+            memory = std::stod(argv[++i]);
+        else if (flag == "--cores")
+            cores = std::stoull(argv[++i]);
+        else if (flag == "--build-dir")
+            values["build"] = argv[++i];
+        else if (flag == "--states")
+            values["states"] = argv[++i];
+        else if (flag == "--clickstream")
+            values["clickstream"] = argv[++i];
+        else if (flag == "--memory" || flag == "--cores-for")
+        {
+            if (i + 2 >= argc)
+                return usage();
+            auto it = find_stage(argv[i + 1]);
+            if (flag == "--memory")
+                it->memory = std::stod(argv[i + 2]);
+            else
+                it->cores = std::stoull(argv[i + 2]);
+            i += 2;
+        }
+        else
+            return usage();
+    }
+
+    if (courses.empty())
+        return usage();
+
+    if (cores > cpus.size())
+    {
+        LOG(warning) << "Only " << cpus.size() << " cores are available"
+                     << ENDLG;
+        cores = cpus.size();
+    }
+    cpus.resize(cores);
+
+    LOG(info) << "Running " << courses.size() << " courses in "
+              << memory << " GB and " << cores << " cores" << ENDLG;
+
+    auto jobs = make_jobs(courses, stages, values);
+    scheduler sched{std::move(jobs), memory, std::move(cpus), dry_run};
+    return sched.run() ? 0 : 1;
+}
@@ -1,12 +1,21 @@
 /**
  * @file sort.cpp
  * Sorts a Coursera clickstream json file by the timestamp key.
+ *
+ * With --dedup, exact duplicate lines are dropped. Lines are ordered by a
+ * hash of their contents within each timestamp, so identical lines end up
+ * next to each other, both within a chunk and in the merge of the chunks;
+ * only lines with the same timestamp and hash are compared byte by byte.
  */
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <tuple>
 
 #include "json.hpp"
+#include "metrics.h"
 
 #include "meta/hashing/probe_map.h"
 #include "meta/io/filesystem.h"
@@ -15,30 +24,34 @@
 #include "meta/parallel/algorithm.h"
 #include "meta/util/multiway_merge.h"
 #include "meta/util/progress.h"
+#include "meta/util/string_view.h"
 
 using namespace nlohmann;
 using namespace meta;
 
 struct line_record
 {
-    line_record(uint64_t timestamp, uint64_t byte_pos)
-        : timestamp_{timestamp}, byte_pos_{byte_pos}
+    line_record(uint64_t timestamp, uint64_t hash, uint64_t byte_pos)
+        : timestamp_{timestamp}, hash_{hash}, byte_pos_{byte_pos}
     {
         // nothing
     }
 
     uint64_t timestamp_;
+    /// hash of the line when deduplicating, and zero otherwise
+    uint64_t hash_;
     uint64_t byte_pos_;
 };
 
 bool operator<(const line_record& a, const line_record& b)
 {
-    return a.timestamp_ < b.timestamp_;
+    return std::tie(a.timestamp_, a.hash_) < std::tie(b.timestamp_, b.hash_);
 }
 
 struct full_line_record
 {
     uint64_t timestamp;
+    uint64_t hash;
     std::string line;
 
     void merge_with(full_line_record&&)
@@ -48,9 +61,11 @@ struct full_line_record
 
 bool operator<(const full_line_record& a, const full_line_record& b)
 {
-    return a.timestamp < b.timestamp;
+    return std::tie(a.timestamp, a.hash) < std::tie(b.timestamp, b.hash);
 }
 
+// the merge never combines records; duplicates are dropped (when asked
+// to) as the records come out of it
 bool operator==(const full_line_record&, const full_line_record&)
 {
     return false;
@@ -60,12 +75,61 @@ template <class InputStream>
 uint64_t packed_read(InputStream& in, full_line_record& flr)
 {
     using io::packed::read;
-    return read(in, flr.timestamp) + read(in, flr.line);
+    return read(in, flr.timestamp) + read(in, flr.hash) + read(in, flr.line);
+}
+
+/**
+ * @return a hash of the line, never zero
+ */
+uint64_t line_hash(util::string_view line)
+{
+    auto hash = static_cast<uint64_t>(std::hash<util::string_view>{}(line));
+    return hash == 0 ? 1 : hash;
+}
+
+/**
+ * Removes the records whose line is identical to an earlier one's, given
+ * records sorted by timestamp and hash.
+ * @return the number of records removed
+ */
+uint64_t remove_duplicates(std::vector<line_record>& lines,
+                           const std::vector<char>& buffer)
+{
+    auto text = [&](const line_record& rec) {
+        return util::string_view{buffer.data() + rec.byte_pos_};
+    };
+
+    // kept records [run_start, out) share the last kept timestamp and hash
+    uint64_t run_start = 0;
+    uint64_t out = 0;
+    for (uint64_t i = 0; i < lines.size(); ++i)
+    {
+        const auto& rec = lines[i];
+        if (out == 0 || lines[out - 1] < rec)
+        {
+            run_start = out;
+        }
+        else if (std::any_of(lines.begin() + run_start, lines.begin() + out,
+                             [&](const line_record& kept) {
+                                 return text(kept) == text(rec);
+                             }))
+        {
+            continue;
+        }
+        lines[out++] = rec;
+    }
+
+    auto removed = lines.size() - out;
+    lines.erase(lines.begin() + out, lines.end());
+    return removed;
 }
 
 void flush_chunk(uint64_t chunk_num, std::vector<line_record>& lines,
-                 const std::vector<char>& buffer)
+                 const std::vector<char>& buffer, bool dedup)
 {
+    static auto& duplicate_count = metrics::get_counter("duplicates");
+
+    metrics::stage_timer timer{"flush_chunk"};
     LOG(info) << "Sorting chunk " << chunk_num + 1 << " of size "
               << lines.size() << "..." << ENDLG;
 
@@ -77,8 +141,11 @@ void flush_chunk(uint64_t chunk_num, std::vector<line_record>& lines,
 
     {
         parallel::thread_pool pool;
+        metrics::track_threads(pool);
         parallel::sort(lines.begin(), lines.end(), pool);
     }
+    if (dedup)
+        duplicate_count += remove_duplicates(lines, buffer);
 
     LOG(info) << "Flushing chunk " << chunk_num + 1 << "..." << ENDLG;
     printing::progress progress{"> Flushing: ", lines.size()};
@@ -88,6 +155,7 @@ void flush_chunk(uint64_t chunk_num, std::vector<line_record>& lines,
         progress(++lineno);
         util::string_view sv{buffer.data() + rec.byte_pos_};
         io::packed::write(chunk, rec.timestamp_);
+        io::packed::write(chunk, rec.hash_);
         io::packed::write(chunk, sv);
     }
     LOG(info) << "Flushed chunk " << chunk_num + 1 << ENDLG;
@@ -95,9 +163,22 @@ void flush_chunk(uint64_t chunk_num, std::vector<line_record>& lines,
 
 int main(int argc, char** argv)
 {
+    metrics::session session{"sort"};
+    auto& line_count = metrics::get_counter("lines");
+    auto& byte_count = metrics::get_counter("bytes");
+    auto& bad_line_count = metrics::get_counter("bad_lines");
+    auto& duplicate_count = metrics::get_counter("duplicates");
+
     uint64_t max_ram = 1024u * 1024 * 1024 * 8; // 8 GB
-    if (argc >= 2)
-        max_ram = 1024u * 1024 * 1024 * std::stoul(argv[1]);
+    bool dedup = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (flag == "--dedup")
+            dedup = true;
+        else
+            max_ram = 1024u * 1024 * 1024 * std::stoul(argv[i]);
+    }
 
     logging::set_cerr_logging();
 
@@ -112,13 +193,16 @@ int main(int argc, char** argv)
     uint64_t lineno = 0;
     uint64_t bad_lines = 0;
     char* pos = buffer.data();
+    metrics::stage_timer read_timer{"read"};
     while (std::getline(std::cin, line))
     {
         ++lineno;
+        ++line_count;
+        byte_count += line.size() + 1;
         // out of room, so flush a chunk to disk
         if (pos + line.size() + 1 >= buffer.data() + buffer.size())
         {
-            flush_chunk(num_chunks++, lines, buffer);
+            flush_chunk(num_chunks++, lines, buffer, dedup);
 
             lines.clear();
             std::fill(buffer.begin(), buffer.end(), 0);
@@ -129,6 +213,7 @@ int main(int argc, char** argv)
         {
             auto obj = json::parse(line);
             lines.emplace_back(obj["timestamp"].get<uint64_t>(),
+                               dedup ? line_hash(line) : 0,
                                static_cast<uint64_t>(pos - buffer.data()));
 
             // add line to in-memory buffer
@@ -138,6 +223,7 @@ int main(int argc, char** argv)
         catch (const std::exception& ex)
         {
             ++bad_lines;
+            ++bad_line_count;
             LOG(error) << "line " << lineno << ": " << ex.what() << ENDLG;
             LOG(error) << line << ENDLG;
             if (!filesystem::exists("tmp"))
@@ -146,26 +232,55 @@ int main(int argc, char** argv)
         }
     }
 
+    // the time spent reading includes any chunks flushed along the way
+    read_timer.stop();
+
     if (num_chunks > 0)
     {
         if (pos != buffer.data())
-            flush_chunk(num_chunks++, lines, buffer);
+            flush_chunk(num_chunks++, lines, buffer, dedup);
 
         std::vector<util::chunk_iterator<full_line_record>> chunks;
         chunks.reserve(num_chunks);
         for (uint64_t i = 0; i < num_chunks; ++i)
             chunks.emplace_back("tmp/chunk-" + std::to_string(i));
 
+        // the records already written that share the last timestamp and
+        // hash, which are the only ones a new record can duplicate
+        std::vector<full_line_record> run;
+        metrics::stage_timer timer{"merge"};
         util::multiway_merge(
-            chunks.begin(), chunks.end(),
-            [&](full_line_record&& flr) { std::cout << flr.line << "\n"; });
+            chunks.begin(), chunks.end(), [&](full_line_record&& flr) {
+                if (!dedup)
+                {
+                    std::cout << flr.line << "\n";
+                    return;
+                }
+
+                if (!run.empty() && run.back() < flr)
+                    run.clear();
+                for (const auto& prev : run)
+                {
+                    if (prev.line == flr.line)
+                    {
+                        ++duplicate_count;
+                        return;
+                    }
+                }
+                std::cout << flr.line << "\n";
+                run.push_back(std::move(flr));
+            });
     }
     else
     {
+        metrics::stage_timer timer{"sort_in_memory"};
         LOG(info) << "Sorting " << lines.size() << " records in memory..."
                   << ENDLG;
         parallel::thread_pool pool;
+        metrics::track_threads(pool);
         parallel::sort(lines.begin(), lines.end(), pool);
+        if (dedup)
+            duplicate_count += remove_duplicates(lines, buffer);
 
         LOG(info) << "Writing final output..." << ENDLG;
         printing::progress progress{"> Writing: ", lines.size()};
@@ -180,6 +295,11 @@ int main(int argc, char** argv)
 
     LOG(info) << "Found " << bad_lines << " bad lines out of " << lineno << " ("
               << static_cast<double>(bad_lines) / lineno * 100 << "%)" << ENDLG;
+    if (dedup)
+    {
+        LOG(info) << "Removed " << duplicate_count.value()
+                  << " duplicate lines" << ENDLG;
+    }
 
     return 0;
 }
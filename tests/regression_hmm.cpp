@@ -0,0 +1,432 @@
+/**
+ * @file regression_hmm.cpp
+ * Trains a hidden Markov model on a fixed synthetic corpus with fixed
+ * seeds, and compares the log likelihood of every iteration, the final
+ * parameters, and the training throughput against a stored baseline.
+ * Noisy machines can turn the throughput check off with --max-slowdown 0.
+ *
+ * The corpus is sampled from a fixed "true" model, and the initial model
+ * is drawn from a fixed seed. Both use raw mt19937 output rather than the
+ * standard distributions (whose results are implementation defined), so
+ * they are the same on every platform. Training uses a fixed number of
+ * threads, so the order of the reductions is fixed too.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <random>
+
+#include "json.hpp"
+#include "model_builder.h"
+#include "retrofit_hmm.h"
+
+#include "meta/logging/logger.h"
+#include "meta/parallel/thread_pool.h"
+#include "meta/sequence/hmm/sequence_observations.h"
+#include "meta/util/identifiers.h"
+#include "meta/util/string_view.h"
+
+using namespace nlohmann;
+using namespace meta;
+
+using hmm_type
+    = sequence::hmm::hidden_markov_model<sequence::hmm::sequence_observations>;
+using sequence::state_id;
+
+const uint64_t num_actions = 10;
+const uint64_t num_states = 3;
+const uint64_t num_students = 600;
+const uint64_t num_iterations = 8;
+const uint64_t num_threads = 4;
+const double smoothing_constant = 1e-6;
+
+/**
+ * A uniform draw from (0, 1), computed directly from the generator's
+ * output.
+ */
+double uniform(std::mt19937& rng)
+{
+    return (rng() + 0.5) / 4294967296.0;
+}
+
+/**
+ * Draws an index from unnormalized weights.
+ */
+uint64_t categorical(std::mt19937& rng, const std::vector<double>& weights)
+{
+    double total = 0;
+    for (const auto& w : weights)
+        total += w;
+
+    auto u = uniform(rng) * total;
+    for (uint64_t i = 0; i + 1 < weights.size(); ++i)
+    {
+        if (u < weights[i])
+            return i;
+        u -= weights[i];
+    }
+    return weights.size() - 1;
+}
+
+/**
+ * Draws a distribution over n outcomes. Small concentrations give
+ * peaked distributions, which make the true states easy to tell apart.
+ */
+std::vector<double> random_distribution(std::mt19937& rng, uint64_t n,
+                                        double concentration)
+{
+    std::vector<double> dist(n);
+    double total = 0;
+    for (auto& p : dist)
+    {
+        p = std::pow(uniform(rng), 1 / concentration);
+        total += p;
+    }
+    for (auto& p : dist)
+        p /= total;
+    return dist;
+}
+
+/**
+ * Draws a hidden Markov model with sequence observations.
+ */
+hmm_type random_model(std::mt19937& rng, double concentration)
+{
+    std::vector<sequence::markov_model> models;
+    for (uint64_t s = 0; s < num_states; ++s)
+    {
+        auto init = random_distribution(rng, num_actions, concentration);
+        std::vector<std::vector<double>> trans;
+        for (uint64_t a = 0; a < num_actions; ++a)
+            trans.push_back(
+                random_distribution(rng, num_actions, concentration));
+        models.push_back(sequence::make_markov_model(
+            init, trans,
+            stats::dirichlet<state_id>{smoothing_constant, num_actions}));
+    }
+
+    auto init = random_distribution(rng, num_states, 1);
+    std::vector<std::vector<double>> trans;
+    for (uint64_t s = 0; s < num_states; ++s)
+        trans.push_back(random_distribution(rng, num_states, 1));
+
+    return sequence::make_hmm<hmm_type>(
+        sequence::make_sequence_observations(models),
+        sequence::make_markov_model(
+            init, trans,
+            stats::dirichlet<state_id>{smoothing_constant, num_states}));
+}
+
+/**
+ * Samples the training corpus from a fixed true model.
+ */
+hmm_type::training_data_type make_corpus()
+{
+    std::mt19937 rng{47};
+    auto truth = random_model(rng, 0.3);
+
+    std::vector<double> weights;
+    auto row = [&](uint64_t n, auto&& prob) {
+        weights.resize(n);
+        for (uint64_t i = 0; i < n; ++i)
+            weights[i] = prob(i);
+        return categorical(rng, weights);
+    };
+
+    hmm_type::training_data_type corpus(num_students);
+    for (auto& student : corpus)
+    {
+        auto num_sessions = 1 + rng() % 8;
+        auto state = row(num_states, [&](uint64_t s) {
+            return truth.init_prob(state_id{s});
+        });
+        for (uint64_t k = 0; k < num_sessions; ++k)
+        {
+            if (k > 0)
+            {
+                state = row(num_states, [&](uint64_t s) {
+                    return truth.trans_prob(state_id{state}, state_id{s});
+                });
+            }
+
+            const auto& mm = truth.observation_distribution(state_id{state});
+            auto length = 2 + rng() % 12;
+            std::vector<state_id> session;
+            auto action = row(num_actions, [&](uint64_t a) {
+                return mm.initial_probability(state_id{a});
+            });
+            session.emplace_back(action);
+            while (session.size() < length)
+            {
+                action = row(num_actions, [&](uint64_t a) {
+                    return mm.transition_probability(state_id{action},
+                                                     state_id{a});
+                });
+                session.emplace_back(action);
+            }
+            student.push_back(std::move(session));
+        }
+    }
+    return corpus;
+}
+
+/**
+ * @return the options for a named training configuration
+ */
+hmm_type::training_options make_options(util::string_view config)
+{
+    hmm_type::training_options options;
+    options.delta = 0;
+    if (config == "batch")
+        return options;
+    if (config == "single-precision")
+        options.single_precision = true;
+    else if (config == "accelerated")
+        options.accelerate = true;
+    else if (config == "online")
+        options.batch_size = 50;
+    else
+        throw std::invalid_argument{"unknown configuration "
+                                    + config.to_string()};
+    return options;
+}
+
+/**
+ * @return every parameter of the model, grouped by kind
+ */
+json parameters(const hmm_type& hmm)
+{
+    std::vector<double> init;
+    std::vector<double> trans;
+    std::vector<double> obs;
+    for (state_id i{0}; i < hmm.num_states(); ++i)
+    {
+        init.push_back(hmm.init_prob(i));
+        for (state_id j{0}; j < hmm.num_states(); ++j)
+            trans.push_back(hmm.trans_prob(i, j));
+
+        const auto& mm = hmm.observation_distribution(i);
+        for (state_id a{0}; a < num_actions; ++a)
+        {
+            obs.push_back(mm.initial_probability(a));
+            for (state_id b{0}; b < num_actions; ++b)
+                obs.push_back(mm.transition_probability(a, b));
+        }
+    }
+    return {{"initial", init}, {"transitions", trans}, {"observations", obs}};
+}
+
+/**
+ * Trains the configuration one iteration at a time, recording the log
+ * likelihood and time of each.
+ */
+json train(util::string_view config,
+           const hmm_type::training_data_type& corpus)
+{
+    std::mt19937 rng{48};
+    auto hmm = random_model(rng, 1);
+
+    auto options = make_options(config);
+    hmm_type::training_state state;
+    state.rng.seed(47);
+    parallel::thread_pool pool{num_threads};
+
+    auto log_likelihoods = json::array();
+    auto seconds = json::array();
+    double total_seconds = 0;
+    for (uint64_t iter = 1; iter <= num_iterations; ++iter)
+    {
+        options.max_iters = iter;
+        auto start = std::chrono::steady_clock::now();
+        hmm.fit(corpus, pool, options, state);
+        std::chrono::duration<double> elapsed
+            = std::chrono::steady_clock::now() - start;
+
+        log_likelihoods.push_back(state.log_likelihood);
+        seconds.push_back(elapsed.count());
+        total_seconds += elapsed.count();
+    }
+
+    return {{"config", config.to_string()},
+            {"log_likelihoods", log_likelihoods},
+            {"parameters", parameters(hmm)},
+            {"seconds", seconds},
+            {"instances_per_second",
+             corpus.size() * num_iterations / total_seconds}};
+}
+
+/**
+ * Collects the differences between a run and its baseline.
+ */
+class comparison
+{
+  public:
+    comparison(double tolerance, double max_slowdown)
+        : tolerance_{tolerance}, max_slowdown_{max_slowdown}
+    {
+        // nothing
+    }
+
+    /**
+     * Checks that each value is within the tolerance of its baseline,
+     * relative to the magnitude of the baseline (or absolutely, for
+     * values below one).
+     */
+    void values(const std::string& what, const json& expected,
+                const json& actual)
+    {
+        if (expected.size() != actual.size())
+        {
+            fail(what + ": expected " + std::to_string(expected.size())
+                 + " values, got " + std::to_string(actual.size()));
+            return;
+        }
+
+        double worst = 0;
+        uint64_t worst_idx = 0;
+        for (uint64_t i = 0; i < expected.size(); ++i)
+        {
+            auto e = expected[i].get<double>();
+            auto a = actual[i].get<double>();
+            auto diff = std::abs(a - e) / std::max(1.0, std::abs(e));
+            if (!(diff <= worst))
+            {
+                worst = diff;
+                worst_idx = i;
+            }
+        }
+
+        if (!(worst <= tolerance_))
+        {
+            std::ostringstream msg;
+            msg << std::setprecision(17) << what << "[" << worst_idx
+                << "]: expected " << expected[worst_idx].get<double>()
+                << ", got " << actual[worst_idx].get<double>()
+                << " (difference " << worst << " > tolerance "
+                << tolerance_ << ")";
+            fail(msg.str());
+        }
+    }
+
+    /**
+     * Checks that the throughput has not dropped by more than the allowed
+     * factor.
+     */
+    void throughput(double expected, double actual)
+    {
+        std::cout << "Throughput: " << actual << " instances/s (baseline "
+                  << expected << ")" << std::endl;
+        if (max_slowdown_ > 0 && actual * max_slowdown_ < expected)
+        {
+            std::ostringstream msg;
+            msg << "throughput: " << actual << " instances/s is more than "
+                << max_slowdown_ << "x slower than the baseline's "
+                << expected;
+            fail(msg.str());
+        }
+    }
+
+    bool passed() const
+    {
+        return failures_ == 0;
+    }
+
+  private:
+    void fail(const std::string& msg)
+    {
+        std::cout << "FAIL " << msg << std::endl;
+        ++failures_;
+    }
+
+    double tolerance_;
+    double max_slowdown_;
+    uint64_t failures_ = 0;
+};
+
+int main(int argc, char** argv)
+{
+    logging::set_cerr_logging(logging::logger::severity_level::warning);
+
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " batch|single-precision|accelerated|online"
+                     " baseline.json [--update] [--tolerance t]"
+                     " [--max-slowdown f]"
+                  << std::endl;
+        return 1;
+    };
+
+    if (argc < 3)
+        return usage();
+
+    util::string_view config{argv[1]};
+    std::string baseline_file = argv[2];
+    bool update = false;
+    // float trellises round differently, so their results drift further
+    double tolerance = config == "single-precision" ? 1e-4 : 1e-7;
+    double max_slowdown = 2;
+    for (int i = 3; i < argc; ++i)
+    {
+        util::string_view flag{argv[i]};
+        if (flag == "--update")
+        {
+            update = true;
+            continue;
+        }
+
+        if (i + 1 == argc)
+            return usage();
+
+        if (flag == "--tolerance")
+            tolerance = std::stod(argv[++i]);
+        else if (flag == "--max-slowdown")
+            max_slowdown = std::stod(argv[++i]);
+        else
+            return usage();
+    }
+
+    auto corpus = make_corpus();
+    auto result = train(config, corpus);
+
+    if (update)
+    {
+        std::ofstream output{baseline_file};
+        output << std::setw(2) << result << "\n";
+        std::cout << "Wrote baseline " << baseline_file << std::endl;
+        return 0;
+    }
+
+    std::ifstream input{baseline_file};
+    if (!input)
+    {
+        std::cout << "FAIL no baseline at " << baseline_file
+                  << "; record one with `make regression-baselines`"
+                  << std::endl;
+        return 1;
+    }
+    json baseline;
+    input >> baseline;
+
+    comparison cmp{tolerance, max_slowdown};
+    cmp.values("log likelihood", baseline["log_likelihoods"],
+               result["log_likelihoods"]);
+    for (const auto& group : {"initial", "transitions", "observations"})
+    {
+        cmp.values(std::string{group} + " parameters",
+                   baseline["parameters"][group], result["parameters"][group]);
+    }
+    cmp.throughput(baseline["instances_per_second"].get<double>(),
+                   result["instances_per_second"].get<double>());
+
+    if (!cmp.passed())
+    {
+        std::cout << config << ": regression against " << baseline_file
+                  << std::endl;
+        return 1;
+    }
+
+    std::cout << config << ": matches " << baseline_file << std::endl;
+    return 0;
+}